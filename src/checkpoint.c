@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "checkpoint.h"
+#include "util.h"
+#include "pager.h"
+#include "wal.h"
+#include "lock.h"
+
+//writers checkpoint once the log passes WAL_CHECKPOINT_SIZE, in the foreground of whichever write got it there
+//with a checkpointer the handle checkpoints from a thread of its own every 'interval_ms' instead, whenever the
+//log holds anything, and writers only do it themselves as a backstop should the log still grow far past that
+//cached blocks are never written back (the log holds every change until a checkpoint), so there is nothing
+//else to clean ahead of eviction
+//a checkpoint writes the blocks changed since the last one, and the next is put off for as long as those bytes
+//take at 'bytes_per_sec', so a busy log is checkpointed in small steps at a bounded rate
+
+static void _checkpoint_add_ns(struct timespec* t, uint64_t ns) {
+    ns += t->tv_nsec;
+    t->tv_sec += ns / 1000000000;
+    t->tv_nsec = ns % 1000000000;
+}
+
+static bool _checkpoint_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+//returns the bytes written to the index file
+static uint64_t _checkpoint_take(struct DB* db) {
+    lock_exclusive(db);
+    uint64_t before = db->pager->checkpoint_written;
+    if (wal_size(db))
+        pager_checkpoint(db);
+    uint64_t written = db->pager->checkpoint_written - before;
+    lock_release(db);
+    return written;
+}
+
+//sleeps until the next checkpoint is due, returning false once the checkpointer is stopped
+static bool _checkpoint_wait(struct Checkpointer* c, const struct timespec* until) {
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop && pthread_cond_timedwait(&c->cond, &c->lock, until) != ETIMEDOUT) {
+    }
+    bool stop = c->stop;
+    pthread_mutex_unlock(&c->lock);
+    return !stop;
+}
+
+static void* _checkpoint_run(void* arg) {
+    struct DB* db = arg;
+    struct Checkpointer* c = db->checkpointer;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+        _checkpoint_add_ns(&next, (uint64_t)c->interval_ms * 1000000);
+        if (!_checkpoint_wait(c, &next))
+            break;
+
+        uint64_t written = _checkpoint_take(db);
+
+        //a late checkpoint does not make the next one come sooner
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (_checkpoint_before(&next, &now))
+            next = now;
+        if (c->bytes_per_sec)
+            _checkpoint_add_ns(&next, written * 1000000000 / c->bytes_per_sec);
+    }
+    return NULL;
+}
+
+void checkpoint_start(struct DB* db, uint32_t interval_ms, uint64_t bytes_per_sec) {
+    struct Checkpointer* c = _calloc(1, sizeof(struct Checkpointer));
+    c->interval_ms = interval_ms;
+    c->bytes_per_sec = bytes_per_sec;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    db->checkpointer = c;
+    db->pager->checkpoint_size = WAL_CHECKPOINT_SIZE * CHECKPOINT_BACKSTOP;
+    if (pthread_create(&c->thread, NULL, _checkpoint_run, db))
+        err_quit("pthread_create failed");
+}
+
+//waits for a checkpoint under way to finish
+void checkpoint_stop(struct DB* db) {
+    struct Checkpointer* c = db->checkpointer;
+    if (!c)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c);
+    db->checkpointer = NULL;
+    db->pager->checkpoint_size = WAL_CHECKPOINT_SIZE;
+}
@@ -0,0 +1,25 @@
+#ifndef UDB_CHECKPOINT_H
+#define UDB_CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "urchin.h"
+
+#define CHECKPOINT_BACKSTOP 4 //with a checkpointer running, writers only checkpoint a log this many times the usual size
+
+//a thread taking checkpoints for a handle, see checkpoint.c
+struct Checkpointer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    uint32_t interval_ms;
+    uint64_t bytes_per_sec;
+};
+
+void checkpoint_start(struct DB* db, uint32_t interval_ms, uint64_t bytes_per_sec);
+void checkpoint_stop(struct DB* db);
+
+#endif //UDB_CHECKPOINT_H
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io.h"
+#include "util.h"
+
+//each thread submits through an io_uring of its own, set up on its first batch and torn down when the thread
+//exits, so threads never wait on each other's I/O; a thread that cannot set one up (a kernel without io_uring,
+//or one that forbids it) runs its batches with blocking calls instead
+//the rings are used through the raw system calls, so nothing beyond the kernel headers is needed
+struct IoRing {
+    int fd;
+    char* sq_ptr;
+    size_t sq_size;
+    char* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+static pthread_key_t _io_key;
+static pthread_once_t _io_once = PTHREAD_ONCE_INIT;
+static __thread struct IoRing* _io_ring;
+static __thread bool _io_no_ring;
+
+static void _io_ring_free(void* arg) {
+    struct IoRing* r = arg;
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    free(r);
+}
+
+//a child process shares the rings mapped by its parent, so the forking thread drops its own
+static void _io_after_fork(void) {
+    if (_io_ring) {
+        _io_ring_free(_io_ring);
+        _io_ring = NULL;
+        pthread_setspecific(_io_key, NULL);
+    }
+}
+
+static void _io_init(void) {
+    if (pthread_key_create(&_io_key, _io_ring_free))
+        err_quit("pthread_key_create failed");
+    pthread_atfork(NULL, NULL, _io_after_fork);
+}
+
+static char* _io_map(int fd, size_t size, off_t off) {
+    char* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+    if (ptr == MAP_FAILED)
+        err_quit("mmap failed");
+    return ptr;
+}
+
+//returns the calling thread's ring, or NULL if it has none
+static struct IoRing* _io_ring_get(void) {
+    if (_io_ring || _io_no_ring)
+        return _io_ring;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    int fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (fd < 0) {
+        _io_no_ring = true;
+        return NULL;
+    }
+
+    struct IoRing* r = _calloc(1, sizeof(struct IoRing));
+    r->fd = fd;
+    r->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_size = r->sq_size > r->cq_size ? r->sq_size : r->cq_size;
+        r->sq_ptr = _io_map(fd, r->sq_size, IORING_OFF_SQ_RING);
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->sq_ptr = _io_map(fd, r->sq_size, IORING_OFF_SQ_RING);
+        r->cq_ptr = _io_map(fd, r->cq_size, IORING_OFF_CQ_RING);
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)_io_map(fd, r->sqes_size, IORING_OFF_SQES);
+
+    r->sq_tail = (uint32_t*)(r->sq_ptr + params.sq_off.tail);
+    r->sq_mask = (uint32_t*)(r->sq_ptr + params.sq_off.ring_mask);
+    r->sq_array = (uint32_t*)(r->sq_ptr + params.sq_off.array);
+    r->cq_head = (uint32_t*)(r->cq_ptr + params.cq_off.head);
+    r->cq_tail = (uint32_t*)(r->cq_ptr + params.cq_off.tail);
+    r->cq_mask = (uint32_t*)(r->cq_ptr + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(r->cq_ptr + params.cq_off.cqes);
+
+    pthread_once(&_io_once, _io_init);
+    pthread_setspecific(_io_key, r);
+    _io_ring = r;
+    return r;
+}
+
+static void _io_run_blocking(struct IoOp* op) {
+    if (op->write)
+        _pwritev(op->fd, op->iov, op->iov_count, op->off);
+    else
+        _preadv(op->fd, op->iov, op->iov_count, op->off);
+}
+
+static size_t _io_op_len(struct IoOp* op) {
+    size_t len = 0;
+    for (uint32_t i = 0; i < op->iov_count; i++) {
+        len += op->iov[i].iov_len;
+    }
+    return len;
+}
+
+//queues every op of the batch, then submits them and waits for their completions with as few calls as it takes
+//an op that completes short is done again with a blocking call, which reports it the usual way
+static void _io_ring_run(struct IoRing* r, struct IoBatch* b) {
+    uint32_t tail = *r->sq_tail;
+    for (uint32_t i = 0; i < b->count; i++) {
+        struct IoOp* op = &b->ops[i];
+        uint32_t idx = tail & *r->sq_mask;
+        struct io_uring_sqe* sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = op->fd;
+        sqe->addr = (uintptr_t)op->iov;
+        sqe->len = op->iov_count;
+        sqe->off = op->off;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    uint32_t submitted = 0;
+    uint32_t done = 0;
+    while (done < b->count) {
+        int res = syscall(__NR_io_uring_enter, r->fd, b->count - submitted, b->count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            err_quit("io_uring_enter failed");
+        }
+        submitted += res;
+
+        uint32_t head = *r->cq_head;
+        uint32_t cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            struct IoOp* op = &b->ops[cqe->user_data];
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                err_quit(op->write ? "io_uring write failed" : "io_uring read failed");
+            }
+            if ((size_t)cqe->res < _io_op_len(op))
+                _io_run_blocking(op);
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+void io_batch_add(struct IoBatch* b, int fd, bool write, struct iovec* iov, uint32_t iov_count, uint64_t off) {
+    if (b->count == IO_BATCH_MAX)
+        err_quit("io batch full");
+
+    b->ops[b->count++] = (struct IoOp){ fd, write, iov, iov_count, off };
+}
+
+//runs every op of the batch, through the calling thread's ring if 'uring' is set and it has one
+//a batch of one is run with a blocking call either way, there being nothing to overlap
+void io_batch_run(struct IoBatch* b, bool uring) {
+    struct IoRing* r = uring && b->count > 1 ? _io_ring_get() : NULL;
+    if (r) {
+        _io_ring_run(r, b);
+    } else {
+        for (uint32_t i = 0; i < b->count; i++) {
+            _io_run_blocking(&b->ops[i]);
+        }
+    }
+    b->count = 0;
+}
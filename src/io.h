@@ -0,0 +1,30 @@
+#ifndef UDB_IO_H
+#define UDB_IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define IO_BATCH_MAX 64
+#define IO_RING_ENTRIES IO_BATCH_MAX
+
+//one positional vectored read or write of a batch
+//the iovecs and the buffers they point to must stay put until the batch has run
+struct IoOp {
+    int fd;
+    bool write;
+    struct iovec* iov;
+    uint32_t iov_count;
+    uint64_t off;
+};
+
+//reads and writes that do not depend on each other, started together and all finished by io_batch_run
+struct IoBatch {
+    uint32_t count;
+    struct IoOp ops[IO_BATCH_MAX];
+};
+
+void io_batch_add(struct IoBatch* b, int fd, bool write, struct iovec* iov, uint32_t iov_count, uint64_t off);
+void io_batch_run(struct IoBatch* b, bool uring);
+
+#endif //UDB_IO_H
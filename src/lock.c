@@ -0,0 +1,211 @@
+#define _GNU_SOURCE //writer-preferring rwlocks
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "lock.h"
+#include "util.h"
+#include "pager.h"
+#include "wal.h"
+
+#define LOCK_JOIN_CHECK 64
+
+//processes sharing a database lock byte ranges of the index file with fcntl:
+//- hash table writers hold the super lock shared, so the table layout cannot change under them
+//- a writer holds the lock of the one bucket it changes, and the allocator lock (free lists, heap end and
+//  record count) only once it allocates or frees space; both are held until its frame is in the log
+//- the log lock is taken to append a frame, so frames from different writers never overlap, and is dropped
+//  with the rest right after
+//- splits, compaction, transactions and the B+tree engine lock the whole file, excluding all of the above
+//writers under the super lock only ever change bytes that their own bucket and allocator locks cover,
+//so frames committed in between can be replayed onto their cached blocks; every lock taken is followed
+//by catching up with the log, since the last holder may have committed changes this process has not read
+//
+//readers take none of those: they read a snapshot, the index file as of the last checkpoint plus a prefix
+//of the committed log (see pager.c), so all they need is for the index file to stay as it is - they hold
+//the snapshot lock shared, which lies outside the "whole file" and only a checkpoint takes
+//the snapshot and checkpoint locks are open file description locks: a checkpoint may wait for them while holding
+//the whole file, and fcntl would call that a deadlock with any reader's process where a writer waits for the file
+//
+//fcntl locks belong to the process, so threads sharing a handle are kept apart by two latches:
+//- writers hold the handle latch alone, from their first lock to lock_release
+//- readers hold the snapshot latch shared, and the first one in takes the snapshot lock for the others;
+//  a checkpoint holds the latch alone, so snapshots in this process and in others never span one
+//readers do not wait for writers to catch up with the log: frames newer than the last catch up are only
+//read if the handle latch is free, and a snapshot without them is just as consistent
+
+void lock_init(struct DB* db) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&db->latch, &attr);
+    pthread_rwlock_init(&db->snap_latch, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&db->readers_lock, NULL);
+    pthread_cond_init(&db->readers_cond, NULL);
+    db->readers = 0;
+    db->reader_joins = 0;
+    db->snapshots_locked = false;
+    db->snapshots_draining = false;
+}
+
+void lock_destroy(struct DB* db) {
+    pthread_rwlock_destroy(&db->latch);
+    pthread_rwlock_destroy(&db->snap_latch);
+    pthread_mutex_destroy(&db->readers_lock);
+    pthread_cond_destroy(&db->readers_cond);
+}
+
+//while this process checkpoints it holds the snapshot lock exclusively, and readers waiting for the latch
+//get it back shared when the checkpoint is done
+//threads joining a snapshot lock already held would keep it from ever being let go, so every so often they
+//check for a checkpoint in another process waiting for it, and if there is one, wait for the holders to drain
+static void _lock_read_snapshots(struct DB* db) {
+    pthread_mutex_lock(&db->readers_lock);
+    if (db->readers && !db->snapshots_locked && !db->snapshots_draining && ++db->reader_joins % LOCK_JOIN_CHECK == 0)
+        db->snapshots_draining = _ofd_write_locked(db->idxfd, LOCK_CHECKPOINT_OFF, 1);
+    while (db->snapshots_draining) {
+        pthread_cond_wait(&db->readers_cond, &db->readers_lock);
+    }
+
+    if (db->readers++ == 0 && !db->snapshots_locked) {
+        if (_ofd_write_locked(db->idxfd, LOCK_CHECKPOINT_OFF, 1)) {
+            _ofd_lock(db->idxfd, F_RDLCK, LOCK_CHECKPOINT_OFF, 1, true);
+            _ofd_lock(db->idxfd, F_UNLCK, LOCK_CHECKPOINT_OFF, 1, true);
+        }
+        _ofd_lock(db->idxfd, F_RDLCK, LOCK_SNAPSHOT_OFF, 1, true);
+        db->reader_joins = 0;
+    }
+    pthread_mutex_unlock(&db->readers_lock);
+}
+
+static void _unlock_read_snapshots(struct DB* db) {
+    pthread_mutex_lock(&db->readers_lock);
+    if (--db->readers == 0) {
+        if (!db->snapshots_locked)
+            _ofd_lock(db->idxfd, F_UNLCK, LOCK_SNAPSHOT_OFF, 1, true);
+        db->snapshots_draining = false;
+        pthread_cond_broadcast(&db->readers_cond);
+    }
+    pthread_mutex_unlock(&db->readers_lock);
+}
+
+//catching up patches cached blocks and the log, so it is done holding the handle latch
+//a reader only waits for the latch if the handle missed a checkpoint, since its blocks no longer match the file
+static void _lock_catch_up(struct DB* db) {
+    if (wal_stale(db))
+        pthread_rwlock_wrlock(&db->latch);
+    else if (pthread_rwlock_trywrlock(&db->latch))
+        return;
+
+    _read_lock(db->idxfd, SEEK_SET, LOCK_SUPER_OFF, 1);
+    pager_begin(db);
+    _unlock(db->idxfd, SEEK_SET, LOCK_SUPER_OFF, 1);
+    pthread_rwlock_unlock(&db->latch);
+}
+
+//gives the calling thread a snapshot to read, kept until unlock_read
+//a checkpoint by another process can slip in before the snapshot lock is taken, in which case
+//the handle catches up with it and tries again
+void lock_read(struct DB* db) {
+    for (;;) {
+        if (wal_behind(db))
+            _lock_catch_up(db);
+
+        _lock_read_snapshots(db);
+        pthread_rwlock_rdlock(&db->snap_latch);
+        if (pager_snapshot_begin(db))
+            return;
+
+        pthread_rwlock_unlock(&db->snap_latch);
+        _unlock_read_snapshots(db);
+    }
+}
+
+void unlock_read(struct DB* db) {
+    pager_snapshot_end(db);
+    pthread_rwlock_unlock(&db->snap_latch);
+    _unlock_read_snapshots(db);
+}
+
+//waits for readers in this process to finish and keeps new ones out, then takes the snapshot lock
+//if readers in another process hold snapshots it returns false, unless 'wait' is set: it then holds the
+//checkpoint lock while it waits, which keeps their new readers out until the lock is free
+//NOTE: handle latch should be held
+bool lock_snapshots(struct DB* db, bool wait) {
+    pthread_rwlock_wrlock(&db->snap_latch);
+    pthread_mutex_lock(&db->readers_lock);
+    if (wait) {
+        _ofd_lock(db->idxfd, F_WRLCK, LOCK_CHECKPOINT_OFF, 1, true);
+        _ofd_lock(db->idxfd, F_WRLCK, LOCK_SNAPSHOT_OFF, 1, true);
+        _ofd_lock(db->idxfd, F_UNLCK, LOCK_CHECKPOINT_OFF, 1, true);
+        db->snapshots_locked = true;
+    } else {
+        db->snapshots_locked = _ofd_lock(db->idxfd, F_WRLCK, LOCK_SNAPSHOT_OFF, 1, false);
+    }
+    bool locked = db->snapshots_locked;
+    pthread_mutex_unlock(&db->readers_lock);
+
+    if (!locked)
+        pthread_rwlock_unlock(&db->snap_latch);
+    return locked;
+}
+
+void unlock_snapshots(struct DB* db) {
+    pthread_mutex_lock(&db->readers_lock);
+    if (db->readers)
+        _ofd_lock(db->idxfd, F_RDLCK, LOCK_SNAPSHOT_OFF, 1, true);
+    else
+        _ofd_lock(db->idxfd, F_UNLCK, LOCK_SNAPSHOT_OFF, 1, true);
+    db->snapshots_locked = false;
+    pthread_mutex_unlock(&db->readers_lock);
+    pthread_rwlock_unlock(&db->snap_latch);
+}
+
+void lock_shared(struct DB* db) {
+    pthread_rwlock_wrlock(&db->latch);
+    _read_lock(db->idxfd, SEEK_SET, LOCK_SUPER_OFF, 1);
+    db->lock_mode = DB_LOCK_SHARED;
+    pager_begin(db);
+}
+
+void lock_exclusive(struct DB* db) {
+    pthread_rwlock_wrlock(&db->latch);
+    _write_lock(db->idxfd, SEEK_SET, 0, LOCK_SNAPSHOT_OFF);
+    db->lock_mode = DB_LOCK_EXCLUSIVE;
+    pager_begin(db);
+}
+
+void lock_bucket(struct DB* db, uint32_t bucket) {
+    if (db->lock_mode != DB_LOCK_SHARED)
+        return;
+
+    _write_lock(db->idxfd, SEEK_SET, LOCK_BUCKET_OFF + bucket, 1);
+    pager_begin(db);
+}
+
+void lock_alloc(struct DB* db) {
+    if (db->lock_mode != DB_LOCK_SHARED || db->alloc_locked)
+        return;
+
+    _write_lock(db->idxfd, SEEK_SET, LOCK_ALLOC_OFF, 1);
+    db->alloc_locked = true;
+    pager_begin(db);
+}
+
+//leaves the log caught up, so the next frame goes at its end
+void lock_log(struct DB* db) {
+    if (db->lock_mode != DB_LOCK_SHARED)
+        return;
+
+    _write_lock(db->idxfd, SEEK_SET, LOCK_LOG_OFF, 1);
+    pager_begin(db);
+}
+
+//drops every lock the writer holds
+void lock_release(struct DB* db) {
+    _unlock(db->idxfd, SEEK_SET, 0, LOCK_SNAPSHOT_OFF);
+    db->lock_mode = DB_LOCK_NONE;
+    db->alloc_locked = false;
+    pthread_rwlock_unlock(&db->latch);
+}
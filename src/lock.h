@@ -0,0 +1,31 @@
+#ifndef UDB_LOCK_H
+#define UDB_LOCK_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "urchin.h"
+
+//lock bytes lie past any offset a 32-bit heap can reach, so they never cover data
+#define LOCK_SUPER_OFF ((off_t)1 << 40)
+#define LOCK_ALLOC_OFF (LOCK_SUPER_OFF + 1)
+#define LOCK_LOG_OFF (LOCK_SUPER_OFF + 2)
+#define LOCK_BUCKET_OFF (LOCK_SUPER_OFF + 64) //one byte per hash bucket
+#define LOCK_SNAPSHOT_OFF ((off_t)1 << 41) //past every other lock byte, which a whole file lock ends before
+#define LOCK_CHECKPOINT_OFF (LOCK_SNAPSHOT_OFF + 1) //held by a checkpoint waiting for the snapshot lock
+#define LOCK_POOL_OFF (LOCK_SNAPSHOT_OFF + 2) //read-locked by every handle mapping the shared pool
+
+void lock_init(struct DB* db);
+void lock_destroy(struct DB* db);
+void lock_read(struct DB* db);
+void unlock_read(struct DB* db);
+bool lock_snapshots(struct DB* db, bool wait);
+void unlock_snapshots(struct DB* db);
+void lock_shared(struct DB* db);
+void lock_exclusive(struct DB* db);
+void lock_bucket(struct DB* db, uint32_t bucket);
+void lock_alloc(struct DB* db);
+void lock_log(struct DB* db);
+void lock_release(struct DB* db);
+
+#endif //UDB_LOCK_H
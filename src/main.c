@@ -4,10 +4,12 @@
 #include <stdbool.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include "urchin.h"
 
 int standard_test() {
-    struct DB* db = db_open("test");
+    struct DB* db = db_open("test", NULL);
 
     
     if (db_store(db, "lion", "lion data") != 0)
@@ -37,7 +39,7 @@ int standard_test() {
 }
 
 int data_persistence_test() {
-    struct DB* db = db_open("test");
+    struct DB* db = db_open("test", NULL);
     if (db_store(db, "dog", "dog data") != 0)
         err_quit("db_store failed");
     if (db_store(db, "cat", "cat data") != 0)
@@ -46,7 +48,7 @@ int data_persistence_test() {
         err_quit("db_store failed");
     db_close(db);
 
-    db = db_open("test");
+    db = db_open("test", NULL);
     printf("dog: %s\n", db_fetch(db, "dog"));
     printf("cat: %s\n", db_fetch(db, "cat"));
     printf("bird: %s\n", db_fetch(db, "bird"));
@@ -55,7 +57,7 @@ int data_persistence_test() {
 }
 
 int file_locking_test(int argc, char** argv) {
-    struct DB* db = db_open("test");
+    struct DB* db = db_open("test", NULL);
     const int len = 5000;
     char msg1[len];
     char msg2[len];
@@ -93,11 +95,11 @@ int file_locking_test(int argc, char** argv) {
 }
 
 int stale_fetch_test() {
-    struct DB* db1 = db_open("test");
+    struct DB* db1 = db_open("test", NULL);
     if (db_store(db1, "dog", "dog data") != 0)
         err_quit("db_store failed");
 
-    struct DB* db2 = db_open("test");
+    struct DB* db2 = db_open("test", NULL);
     printf("dog: %s\n", db_fetch(db2, "dog"));
 
     if (db_store(db1, "dog", "new dog data") != 0)
@@ -112,8 +114,8 @@ int stale_fetch_test() {
 }
 
 int stale_delete_test() {
-    struct DB* db1 = db_open("test");
-    struct DB* db2 = db_open("test");
+    struct DB* db1 = db_open("test", NULL);
+    struct DB* db2 = db_open("test", NULL);
 
     if (db_store(db1, "dog", "dog data") != 0)
         err_quit("db_store failed");
@@ -131,10 +133,788 @@ int stale_delete_test() {
     return 0;
 }
 
+int transaction_test() {
+    struct DB* db = db_open("test", NULL);
+
+    db_begin(db);
+    db_store(db, "dog", "dog data");
+    db_store(db, "cat", "cat data");
+    db_commit(db);
+
+    db_begin(db);
+    db_delete(db, "dog");
+    db_store(db, "cat", "new cat data");
+    db_abort(db);
+
+    printf("dog: %s\n", db_fetch(db, "dog"));
+    printf("cat: %s\n", db_fetch(db, "cat"));
+
+    struct DbWriteOp ops[] = {
+        {DB_WRITE_DELETE, "dog", NULL},
+        {DB_WRITE_STORE, "cat", "batched cat data"}
+    };
+    if (db_write_batch(db, ops, 2) != 0)
+        err_quit("db_write_batch failed");
+
+    if (db_fetch(db, "dog")) {
+        printf("test failed\n");
+    } else {
+        printf("cat: %s\n", db_fetch(db, "cat"));
+    }
+
+    db_close(db);
+    return 0;
+}
+
+static int print_record(const char* key, const char* value, void* arg) {
+    (void)arg;
+    printf("%s: %s\n", key, value);
+    return 0;
+}
+
+int range_test() {
+    struct DBOptions opts = {0};
+    opts.engine = DB_ENGINE_BTREE;
+    struct DB* db = db_open("test", &opts);
+
+    for (int i = 0; i < 20; i++) {
+        char key_buf[1024];
+        sprintf(key_buf, "age%02d", (i * 7) % 20);
+        if (db_store(db, key_buf, "student") != 0)
+            err_quit("db_store failed");
+    }
+
+    //age > 0 and age < 10
+    if (db_range(db, "age01", "age09", print_record, NULL) != 0)
+        err_quit("db_range failed");
+
+    db_close(db);
+    return 0;
+}
+
+//keys and values holding NUL bytes, read back with db_get_into and db_get_view
+//a view keeps the value it was given while the key is overwritten, then db_fetch and db_get_into are timed
+int slice_test(enum DbEngine engine, int n) {
+    struct DBOptions opts = {0};
+    opts.engine = engine;
+    opts.no_sync = true;
+    struct DB* db = db_open("test", &opts);
+
+    struct DbSlice key = {"k\0ey", 4};
+    struct DbSlice value = {"v\0\0alue", 8};
+    if (db_put(db, key, value) != 0)
+        err_quit("db_put failed");
+
+    char buf[8];
+    uint32_t len;
+    if (db_get_into(db, key, buf, 3, &len) != 0 || len != 8 || memcmp(buf, "v\0\0", 3) != 0)
+        printf("test failed: short buffer\n");
+    if (db_get_into(db, key, buf, sizeof(buf), &len) != 0 || memcmp(buf, value.data, 8) != 0)
+        printf("test failed: get_into\n");
+
+    struct DbView view;
+    if (db_get_view(db, key, &view) != 0)
+        err_quit("db_get_view failed");
+    db_put(db, key, (struct DbSlice){"other", 5});
+    if (view.len != 8 || memcmp(view.data, value.data, 8) != 0)
+        printf("test failed: view changed\n");
+    db_view_release(db, &view);
+
+    if (db_get_view(db, key, &view) != 0 || view.len != 5 || memcmp(view.data, "other", 5) != 0)
+        printf("test failed: view\n");
+    db_view_release(db, &view);
+
+    db_del(db, key);
+    if (db_get_into(db, key, buf, sizeof(buf), &len) != -1)
+        printf("test failed: delete\n");
+
+    char key_buf[32];
+    for (int i = 0; i < n; i++) {
+        sprintf(key_buf, "key%d", i);
+        db_store(db, key_buf, "some value of average length");
+    }
+
+    clock_t start = clock();
+    for (int i = 0; i < n; i++) {
+        sprintf(key_buf, "key%d", i);
+        free(db_fetch(db, key_buf));
+    }
+    printf("db_fetch: %f s\n", (clock() - start) / (double)CLOCKS_PER_SEC);
+
+    start = clock();
+    for (int i = 0; i < n; i++) {
+        sprintf(key_buf, "key%d", i);
+        char value_buf[64];
+        db_get_into(db, (struct DbSlice){key_buf, strlen(key_buf)}, value_buf, sizeof(value_buf), &len);
+    }
+    printf("db_get_into: %f s\n", (clock() - start) / (double)CLOCKS_PER_SEC);
+
+    db_close(db);
+    return 0;
+}
+
+struct CursorTestArg {
+    struct DB* db;
+    uint32_t part;
+    uint32_t parts;
+    int count;
+};
+
+//reads one partition, checking that every value belongs to its key
+static void* _cursor_test_worker(void* arg) {
+    struct CursorTestArg* a = arg;
+    struct DbCursor* c = db_cursor_open(a->db, a->part, a->parts);
+    struct DbSlice key, value;
+    while (db_cursor_next(c, &key, &value) == 0) {
+        if (key.len < 3 || value.len != key.len + 2 || memcmp(value.data + 5, key.data + 3, key.len - 3) != 0)
+            err_quit("value does not match its key");
+        a->count++;
+    }
+    db_cursor_close(c);
+    return NULL;
+}
+
+//n records scanned by 1, 2, 4 ... max_threads threads, each reading its own partition
+int cursor_test(enum DbEngine engine, int max_threads, int n) {
+    struct DBOptions opts = {0};
+    opts.engine = engine;
+    opts.no_sync = true;
+    struct DB* db = db_open("test", &opts);
+
+    db_begin(db);
+    for (int i = 0; i < n; i++) {
+        char key_buf[32];
+        char data_buf[32];
+        sprintf(key_buf, "key%d", i);
+        sprintf(data_buf, "value%d", i);
+        db_store(db, key_buf, data_buf);
+    }
+    db_commit(db);
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        pthread_t tids[64];
+        struct CursorTestArg args[64];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < threads; t++) {
+            args[t] = (struct CursorTestArg){ db, t, threads, 0 };
+            pthread_create(&tids[t], NULL, _cursor_test_worker, &args[t]);
+        }
+        int count = 0;
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+            count += args[t].count;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (count != n)
+            printf("test failed: %d records scanned\n", count);
+        double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%d threads: %.0f records/s\n", threads, n / secs);
+    }
+
+    db_close(db);
+    return 0;
+}
+
+//n records big enough to spread over many blocks, loaded (with their checkpoints) and then fetched
+//with blocking I/O and with io_uring, which should read and write back the same data
+int async_io_test(int n) {
+    char value[600];
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+
+    for (int async = 0; async <= 1; async++) {
+        unlink("test.idx");
+        unlink("test.wal");
+        struct DBOptions opts = {0};
+        opts.no_sync = true;
+        opts.async_io = async;
+        struct DB* db = db_open("test", &opts);
+
+        clock_t start = clock();
+        db_begin(db);
+        for (int i = 0; i < n; i++) {
+            char key_buf[32];
+            sprintf(key_buf, "key%d", i);
+            db_store(db, key_buf, value);
+        }
+        db_commit(db);
+
+        for (int i = 0; i < n; i++) {
+            char key_buf[32];
+            sprintf(key_buf, "key%d", rand() % n);
+            char* data = db_fetch(db, key_buf);
+            if (!data || strcmp(data, value) != 0)
+                printf("test failed: %s\n", key_buf);
+            free(data);
+        }
+        printf("%s: %f s\n", async ? "io_uring" : "blocking", (clock() - start) / (double)CLOCKS_PER_SEC);
+        db_close(db);
+    }
+    return 0;
+}
+
+//n single writes, with checkpoints left to the writers and then taken by a background checkpointer
+//the slowest write is the one that checkpointed, so it should be much faster with the checkpointer
+int checkpoint_test(int n) {
+    char value[200];
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+
+    for (int background = 0; background <= 1; background++) {
+        unlink("test.idx");
+        unlink("test.wal");
+        struct DBOptions opts = {0};
+        opts.no_sync = true;
+        opts.checkpoint_ms = background ? 10 : 0;
+        opts.checkpoint_bytes_per_sec = 256 * 1024 * 1024;
+        struct DB* db = db_open("test", &opts);
+
+        struct timespec start, end;
+        double slowest = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i++) {
+            char key_buf[32];
+            sprintf(key_buf, "key%d", i);
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            db_store(db, key_buf, value);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            double took = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            if (took > slowest)
+                slowest = took;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (int i = 0; i < n; i++) {
+            char key_buf[32];
+            sprintf(key_buf, "key%d", i);
+            char* data = db_fetch(db, key_buf);
+            if (!data || strcmp(data, value) != 0)
+                printf("test failed: %s\n", key_buf);
+            free(data);
+        }
+        printf("%s: %f s, slowest write %f ms\n", background ? "checkpointer" : "writers",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, slowest * 1000);
+        db_close(db);
+    }
+    return 0;
+}
+
+//every third key gets a value of 5 to 50 KB, kept in a value record, the rest small ones kept in their chains
+//small values are then fetched through a small cache, before and after a compaction packs the chains together
+int large_value_test(int n) {
+    unlink("test.idx");
+    unlink("test.wal");
+    struct DBOptions opts = {0};
+    opts.no_sync = true;
+    struct DB* db = db_open("test", &opts);
+
+    char* value = malloc(50000 + 1);
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        char key_buf[32];
+        sprintf(key_buf, "key%d", i);
+        int len = i % 3 == 0 ? 5000 + rand() % 45000 : 100;
+        memset(value, 'a' + i % 26, len);
+        value[len] = '\0';
+        db_store(db, key_buf, value);
+    }
+
+    for (int compacted = 0; compacted <= 1; compacted++) {
+        db_close(db);
+        opts.cache_bytes = 256 * 4096;
+        db = db_open("test", &opts);
+
+        clock_t start = clock();
+        for (int i = 0; i < n; i++) {
+            char key_buf[32];
+            sprintf(key_buf, "key%d", i);
+            char* data = db_fetch(db, key_buf);
+            int len = i % 3 == 0 ? 5000 : 100;
+            if (!data || (int)strlen(data) < len || data[len - 1] != 'a' + i % 26)
+                printf("test failed: %s\n", key_buf);
+            free(data);
+        }
+        printf("%s: all keys %f s\n", compacted ? "compacted" : "loaded", (clock() - start) / (double)CLOCKS_PER_SEC);
+
+        start = clock();
+        for (int r = 0; r < n * 4; r++) {
+            char key_buf[32];
+            int i = rand() % n;
+            sprintf(key_buf, "key%d", i % 3 ? i : (i + 1) % n);
+            free(db_fetch(db, key_buf));
+        }
+        printf("%s: small values %f s\n", compacted ? "compacted" : "loaded", (clock() - start) / (double)CLOCKS_PER_SEC);
+
+        while (db_compact(db, 100000) > 0) {
+        }
+    }
+
+    free(value);
+    db_close(db);
+    return 0;
+}
+
+//checks a value read back by multi_get_test against the one stored for key i
+static bool _multi_get_test_check(int i, const char* data, uint32_t len) {
+    if (!data || len != 100 + (uint32_t)i % 100)
+        return false;
+    for (uint32_t k = 0; k < len; k++) {
+        if (data[k] != 'a' + i % 26)
+            return false;
+    }
+    return true;
+}
+
+//n keys stored 64 at a time with db_multi_put, then read back through a small cache in random batches of 64,
+//a key at a time with db_get_into and a batch at a time with db_multi_get, which should take fewer round trips
+int multi_get_test(int n) {
+    unlink("test.idx");
+    unlink("test.wal");
+    struct DBOptions opts = {0};
+    opts.no_sync = true;
+    opts.async_io = true;
+    struct DB* db = db_open("test", &opts);
+
+    char key_bufs[64][32];
+    char value_bufs[64][200];
+    struct DbSlice keys[64];
+    struct DbSlice values[64];
+    for (int i = 0; i < n; i += 64) {
+        int count = n - i < 64 ? n - i : 64;
+        for (int j = 0; j < count; j++) {
+            keys[j].len = sprintf(key_bufs[j], "key%d", i + j);
+            keys[j].data = key_bufs[j];
+            values[j].len = 100 + (i + j) % 100;
+            memset(value_bufs[j], 'a' + (i + j) % 26, values[j].len);
+            values[j].data = value_bufs[j];
+        }
+        db_multi_put(db, keys, values, count);
+    }
+    db_close(db);
+
+    char buf[64 * 200];
+    int key_ids[64];
+    for (int batched = 0; batched <= 1; batched++) {
+        opts.cache_bytes = 256 * 4096;
+        db = db_open("test", &opts);
+        srand(1);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < n / 64; r++) {
+            for (int j = 0; j < 64; j++) {
+                key_ids[j] = rand() % n;
+                keys[j].len = sprintf(key_bufs[j], "key%d", key_ids[j]);
+                keys[j].data = key_bufs[j];
+            }
+            if (batched) {
+                if (db_multi_get(db, keys, 64, buf, sizeof(buf), values) != 64)
+                    printf("test failed: batch %d\n", r);
+                for (int j = 0; j < 64; j++) {
+                    if (!_multi_get_test_check(key_ids[j], values[j].data, values[j].len))
+                        printf("test failed: %s\n", key_bufs[j]);
+                }
+            } else {
+                for (int j = 0; j < 64; j++) {
+                    uint32_t value_len;
+                    if (db_get_into(db, keys[j], buf, sizeof(buf), &value_len) != 0
+                        || !_multi_get_test_check(key_ids[j], buf, value_len))
+                        printf("test failed: %s\n", key_bufs[j]);
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%s: %f s\n", batched ? "db_multi_get" : "db_get_into",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        db_close(db);
+    }
+    return 0;
+}
+
+//n keys read back in random order through a small cache, one db_fetch after another and then through a fetch
+//queue kept 64 deep, whose fetches are looked up together and miss the cache in batches
+int async_fetch_test(int n) {
+    unlink("test.idx");
+    unlink("test.wal");
+    struct DBOptions opts = {0};
+    opts.no_sync = true;
+    opts.async_io = true;
+    struct DB* db = db_open("test", &opts);
+    db_begin(db);
+    char value_buf[200];
+    for (int i = 0; i < n; i++) {
+        char key_buf[32];
+        sprintf(key_buf, "key%d", i);
+        int len = 100 + i % 100;
+        memset(value_buf, 'a' + i % 26, len);
+        value_buf[len] = '\0';
+        db_store(db, key_buf, value_buf);
+    }
+    db_commit(db);
+    db_close(db);
+
+    struct DbFetch fetches[64];
+    char key_bufs[64][32];
+    int key_ids[64];
+    for (int queued = 0; queued <= 1; queued++) {
+        opts.cache_bytes = 256 * 4096;
+        db = db_open("test", &opts);
+        srand(1);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!queued) {
+            for (int i = 0; i < n; i++) {
+                char key_buf[32];
+                int id = rand() % n;
+                sprintf(key_buf, "key%d", id);
+                char* data = db_fetch(db, key_buf);
+                if (!_multi_get_test_check(id, data, data ? strlen(data) : 0))
+                    printf("test failed: %s\n", key_buf);
+                free(data);
+            }
+        } else {
+            struct DbFetchQueue* q = db_fetch_queue_open(db, 64);
+            struct DbFetch* free_fetches[64];
+            int free_count = 64;
+            for (int j = 0; j < 64; j++) {
+                fetches[j].tag = &key_ids[j];
+                fetches[j].key.data = key_bufs[j];
+                free_fetches[j] = &fetches[j];
+            }
+            for (int i = 0; i < n || free_count < 64; ) {
+                while (i < n && free_count) {
+                    struct DbFetch* f = free_fetches[--free_count];
+                    int* id = f->tag;
+                    *id = rand() % n;
+                    f->key.len = sprintf((char*)f->key.data, "key%d", *id);
+                    if (db_fetch_submit(q, f) != 0)
+                        printf("test failed: submit %d\n", i);
+                    i++;
+                }
+                struct DbFetch* done[64];
+                uint32_t count = db_fetch_reap(q, done, 64, true);
+                for (uint32_t j = 0; j < count; j++) {
+                    if (!_multi_get_test_check(*(int*)done[j]->tag, done[j]->value, done[j]->len))
+                        printf("test failed: %s\n", done[j]->key.data);
+                    free(done[j]->value);
+                    free_fetches[free_count++] = done[j];
+                }
+            }
+            db_fetch_queue_close(q);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%s: %f s\n", queued ? "db_fetch_submit" : "db_fetch",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        db_close(db);
+    }
+    return 0;
+}
+
+//value written by concurrent_write_test for operation i, of length 1 to 700 so that some go into value records
+static int _concurrent_write_test_value(int i, char* data_buf) {
+    int len = 1 + i * 37 % 700;
+    memset(data_buf, 'a' + i % 26, len);
+    data_buf[len] = '\0';
+    return len;
+}
+
+//checks what concurrent_write_test left under key_buf, NULL 'expected' meaning the key should be gone
+static bool _concurrent_write_test_check(struct DB* db, const char* key_buf, const char* expected) {
+    char* data = db_fetch(db, key_buf);
+    bool ok = expected ? data && strcmp(data, expected) == 0 : !data;
+    free(data);
+    return ok;
+}
+
+//n processes each work on their own n keys, for 1, 2, 4 ... max_procs processes: they update, delete and
+//insert keys with values of varying sizes, so they also allocate, free and split buckets as they go
+//writers in different buckets do not wait for each other, so throughput should grow with the process count
+int concurrent_write_test(int max_procs, int n) {
+    struct DBOptions opts = {0};
+    opts.no_sync = true;
+
+    for (int procs = 1; procs <= max_procs; procs *= 2) {
+        unlink("test.idx");
+        unlink("test.wal");
+        struct DB* db = db_open("test", &opts);
+        db_begin(db);
+        for (int i = 0; i < procs * n; i++) {
+            char key_buf[1024];
+            sprintf(key_buf, "key%d", i);
+            db_store(db, key_buf, "data00000");
+        }
+        db_commit(db);
+        db_close(db);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fflush(stdout);
+        for (int p = 0; p < procs; p++) {
+            if (fork() == 0) {
+                struct DB* db = db_open("test", &opts);
+                for (int i = 0; i < n; i++) {
+                    char key_buf[1024];
+                    char data_buf[1024];
+                    _concurrent_write_test_value(i, data_buf);
+                    int rc = 0;
+                    switch (i % 4) {
+                    case 0:
+                        sprintf(key_buf, "key%d", p * n + i);
+                        db_delete(db, key_buf);
+                        break;
+                    case 1:
+                        sprintf(key_buf, "key%d", p * n + i);
+                        rc = db_store(db, key_buf, data_buf);
+                        break;
+                    default:
+                        //every other new key is deleted again
+                        sprintf(key_buf, "new%d", p * n + i);
+                        rc = db_store(db, key_buf, data_buf);
+                        if (rc == 0 && i % 4 == 3)
+                            db_delete(db, key_buf);
+                        break;
+                    }
+                    if (rc != 0)
+                        err_quit("write failed");
+                }
+                db_close(db);
+                exit(0);
+            }
+        }
+        while (wait(NULL) > 0)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%d processes: %.0f writes/s\n", procs, procs * n / secs);
+
+        db = db_open("test", &opts);
+        for (int i = 0; i < procs * n; i++) {
+            int op = i % n % 4;
+            char key_buf[1024];
+            char data_buf[1024];
+            _concurrent_write_test_value(i % n, data_buf);
+            sprintf(key_buf, "key%d", i);
+            if (!_concurrent_write_test_check(db, key_buf, op == 0 ? NULL : op == 1 ? data_buf : "data00000"))
+                printf("test failed: %s\n", key_buf);
+            sprintf(key_buf, "new%d", i);
+            if (!_concurrent_write_test_check(db, key_buf, op == 2 ? data_buf : NULL))
+                printf("test failed: %s\n", key_buf);
+        }
+        db_close(db);
+    }
+    return 0;
+}
+
+//procs processes read every key of a file larger than their private caches, with and without a shared pool
+//with one, blocks another process has loaded come from shared memory instead of the index file
+int shared_cache_test(int procs, int n) {
+    for (int shared = 0; shared <= 1; shared++) {
+        struct DBOptions opts = {0};
+        opts.no_sync = true;
+        opts.cache_bytes = 64 * 1024;
+        opts.shared_cache_bytes = shared ? 64 * 1024 * 1024 : 0;
+
+        unlink("test.idx");
+        unlink("test.wal");
+        struct DB* db = db_open("test", &opts);
+        db_begin(db);
+        for (int i = 0; i < n; i++) {
+            char key_buf[1024];
+            char data_buf[1024];
+            sprintf(key_buf, "key%d", i);
+            sprintf(data_buf, "data%d", i);
+            db_store(db, key_buf, data_buf);
+        }
+        db_commit(db);
+        db_close(db);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fflush(stdout);
+        for (int p = 0; p < procs; p++) {
+            if (fork() == 0) {
+                struct DB* db = db_open("test", &opts);
+                for (int i = 0; i < n; i++) {
+                    char key_buf[1024];
+                    char data_buf[1024];
+                    int k = (i + p * n / procs) % n;
+                    sprintf(key_buf, "key%d", k);
+                    sprintf(data_buf, "data%d", k);
+                    char* data = db_fetch(db, key_buf);
+                    if (!data || strcmp(data, data_buf) != 0)
+                        err_quit("wrong value");
+                    free(data);
+                }
+                db_close(db);
+                exit(0);
+            }
+        }
+        while (wait(NULL) > 0)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%s: %.0f reads/s\n", shared ? "shared pool" : "private pools", procs * n / secs);
+    }
+    return 0;
+}
+
+struct ThreadTestArg {
+    struct DB* db;
+    int id;
+    int n;
+};
+
+//stores its own keys and fetches everyone's, checking that a fetched value is never torn
+static void* _thread_test_worker(void* arg) {
+    struct ThreadTestArg* a = arg;
+    for (int i = 0; i < a->n; i++) {
+        char key_buf[1024];
+        char data_buf[1024];
+        sprintf(key_buf, "key%d-%d", a->id, i);
+        sprintf(data_buf, "data%d-%d", a->id, i);
+        db_store(a->db, key_buf, data_buf);
+
+        for (int j = 0; j < 4; j++) {
+            int id = rand() % (a->id + 1);
+            int k = rand() % (i + 1);
+            sprintf(key_buf, "key%d-%d", id, k);
+            sprintf(data_buf, "data%d-%d", id, k);
+            char* data = db_fetch(a->db, key_buf);
+            if (data && strcmp(data, data_buf) != 0)
+                err_quit("torn read");
+            free(data);
+        }
+    }
+    return NULL;
+}
+
+//many threads sharing one handle
+int concurrent_thread_test(int max_threads, int n) {
+    struct DBOptions opts = {0};
+    opts.no_sync = true;
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        unlink("test.idx");
+        unlink("test.wal");
+        struct DB* db = db_open("test", &opts);
+
+        pthread_t tids[64];
+        struct ThreadTestArg args[64];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int t = 0; t < threads; t++) {
+            args[t] = (struct ThreadTestArg){ db, t, n };
+            pthread_create(&tids[t], NULL, _thread_test_worker, &args[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (int t = 0; t < threads; t++) {
+            for (int i = 0; i < n; i++) {
+                char key_buf[1024];
+                char data_buf[1024];
+                sprintf(key_buf, "key%d-%d", t, i);
+                sprintf(data_buf, "data%d-%d", t, i);
+                char* data = db_fetch(db, key_buf);
+                if (!data || strcmp(data, data_buf) != 0)
+                    err_quit("lost write");
+                free(data);
+            }
+        }
+        db_close(db);
+
+        double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%d threads: %.0f ops/s\n", threads, threads * n * 5 / secs);
+    }
+    return 0;
+}
+
+#define SNAPSHOT_TEST_KEYS 300
+
+struct SnapshotTestArg {
+    struct DB* db;
+    bool done;
+    int scans;
+};
+
+struct SnapshotTestScan {
+    char first[256];
+    int count;
+    int torn;
+};
+
+static int _snapshot_test_check(const char* key, const char* value, void* arg) {
+    (void)key;
+    struct SnapshotTestScan* scan = arg;
+    if (scan->count++ == 0)
+        strcpy(scan->first, value);
+    else if (strcmp(scan->first, value) != 0)
+        scan->torn++;
+    return 0;
+}
+
+//every batch gives all keys the same value, so a scan seeing two values has read across a commit
+static void* _snapshot_test_reader(void* arg) {
+    struct SnapshotTestArg* a = arg;
+    do {
+        struct SnapshotTestScan scan = {{0}, 0, 0};
+        db_range(a->db, NULL, NULL, _snapshot_test_check, &scan);
+        if (scan.torn || scan.count != SNAPSHOT_TEST_KEYS)
+            err_quit("scan saw part of a batch");
+        __atomic_add_fetch(&a->scans, 1, __ATOMIC_RELAXED);
+    } while (!__atomic_load_n(&a->done, __ATOMIC_ACQUIRE));
+    return NULL;
+}
+
+//range scans running alongside a writer rewriting the whole tree, enough times to checkpoint the log
+int snapshot_read_test(int readers, int rounds) {
+    unlink("test.idx");
+    unlink("test.wal");
+    struct DBOptions opts = {0};
+    opts.no_sync = true;
+    opts.engine = DB_ENGINE_BTREE;
+    struct DB* db = db_open("test", &opts);
+
+    char keys[SNAPSHOT_TEST_KEYS][32];
+    char value[256];
+    struct DbWriteOp ops[SNAPSHOT_TEST_KEYS];
+    for (int i = 0; i < SNAPSHOT_TEST_KEYS; i++) {
+        sprintf(keys[i], "key%05d", i);
+        ops[i] = (struct DbWriteOp){ DB_WRITE_STORE, keys[i], value };
+    }
+    sprintf(value, "round-start");
+    db_write_batch(db, ops, SNAPSHOT_TEST_KEYS);
+
+    pthread_t tids[64];
+    struct SnapshotTestArg arg = { db, false, 0 };
+    for (int t = 0; t < readers; t++) {
+        pthread_create(&tids[t], NULL, _snapshot_test_reader, &arg);
+    }
+    for (int r = 0; r < rounds; r++) {
+        sprintf(value, "round-%d-%0*d", r, r % 200, 0);
+        db_write_batch(db, ops, SNAPSHOT_TEST_KEYS);
+    }
+    __atomic_store_n(&arg.done, true, __ATOMIC_RELEASE);
+    for (int t = 0; t < readers; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    db_close(db);
+
+    printf("%d scans during %d batches\n", arg.scans, rounds);
+    return 0;
+}
+
 int paging_test(uint32_t n) {
     //add n records
     uint32_t count;
-    struct DB* db = db_open("test");
+    struct DB* db = db_open("test", NULL);
     for (count = 0; count < n; count++) {
         char key_buf[1024];
         sprintf(key_buf, "key%d", count);
@@ -228,6 +1008,19 @@ int main(int argc, char** argv) {
     //file_locking_test(argc, argv);
     //stale_fetch_test();
     //stale_delete_test();
+    //transaction_test();
+    //range_test();
+    //slice_test(DB_ENGINE_HASH, 200000);
+    //cursor_test(DB_ENGINE_HASH, 8, 1000000);
+    //async_io_test(100000);
+    //checkpoint_test(200000);
+    //large_value_test(20000);
+    //multi_get_test(100000);
+    //async_fetch_test(100000);
+    //concurrent_write_test(8, 20000);
+    //concurrent_thread_test(8, 20000);
+    //snapshot_read_test(4, 200);
+    //shared_cache_test(8, 100000);
     printf("Seconds passed: %f\n", clock() / (double)CLOCKS_PER_SEC);
     return 0;
 }
@@ -1,163 +1,1116 @@
 #include <stddef.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "pager.h"
+#include "wal.h"
+#include "lock.h"
 #include "util.h"
+#include "shared.h"
+#include "io.h"
 
-inline static uint32_t _pager_off_to_idx(uint32_t file_off) {
+//scan hints are set around a scan by the thread running it
+static __thread enum PagerHint _pager_hint = PAGER_HINT_NORMAL;
+//length of the committed log prefix the thread reads, while it holds a snapshot
+static __thread uint32_t _pager_snapshot = PAGER_NO_SNAPSHOT;
+
+inline static uint32_t _pager_off_to_idx(uint64_t file_off) {
     return file_off / BLOCK_SIZE;
 }
 
-static bool _pager_block_is_stale(struct Block* meta, struct Block* b) {
-    uint32_t block_meta_off = sizeof(uint32_t) * 2 * b->idx;
-    uint32_t seconds = *((uint32_t*)(&meta->buf[block_meta_off]));
-    uint32_t counter = *((uint32_t*)(&meta->buf[block_meta_off + sizeof(uint32_t)]));
-    return seconds > b->timestamp.seconds || (seconds == b->timestamp.seconds && counter > b->timestamp.counter);
+inline static uint32_t _pager_hash_idx(struct Pager* p, uint32_t blockidx) {
+    return (blockidx * 2654435761u) & p->table_mask;
+}
+
+//all blocks in one hash chain share a shard lock
+inline static pthread_mutex_t* _pager_shard(struct Pager* p, uint32_t blockidx) {
+    return &p->shards[_pager_hash_idx(p, blockidx) % PAGER_SHARDS];
+}
+
+inline static void _pager_pin(struct Block* b) {
+    __atomic_add_fetch(&b->pins, 1, __ATOMIC_ACQ_REL);
+}
+
+//the last pin of a frame wakes threads waiting in _pager_new_block for one to be unpinned
+inline static void _pager_unpin(struct Pager* p, struct Block* b) {
+    if (__atomic_sub_fetch(&b->pins, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&p->frame_waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&p->list_lock);
+        pthread_cond_broadcast(&p->frame_freed);
+        pthread_mutex_unlock(&p->list_lock);
+    }
+}
+
+//blocks one call may pin at once: half the pool, split between the calls pinning at the same time,
+//so that they leave room for each other and for single pins and views
+static uint32_t _pager_chunk(struct Pager* p) {
+    uint32_t pinners = __atomic_load_n(&p->pinners, __ATOMIC_ACQUIRE);
+    uint32_t chunk = p->frame_count / 2 / (pinners ? pinners : 1);
+    if (chunk > PAGER_IOV_MAX)
+        chunk = PAGER_IOV_MAX;
+    return chunk ? chunk : 1;
 }
 
 static struct Block* _pager_find_block(struct DB* db, uint32_t blockidx) {
-    struct Block* cur = db->blocks;
+    struct Block* cur = db->pager->table[_pager_hash_idx(db->pager, blockidx)];
 
     while (cur) {
         if (cur->idx == blockidx)
             break;
 
-        cur = cur->next;
+        cur = cur->hnext;
     }
 
     return cur;
 }
 
-inline static uint64_t _pager_file_size(FILE* f) {
-    _fseek(f, 0, SEEK_END);
-    return _ftell(f); 
+static void _pager_hash_insert(struct Pager* p, struct Block* b) {
+    uint32_t h = _pager_hash_idx(p, b->idx);
+    b->hnext = p->table[h];
+    p->table[h] = b;
+    b->valid = true;
 }
 
-static void _pager_write_from_block(struct DB* db, struct Block* b, struct TimeStamp ts) {
-    uint32_t ts_off = b->idx * sizeof(uint32_t) * 2;
-    *((uint32_t*)(&db->super->buf[ts_off])) = ts.seconds;
-    *((uint32_t*)(&db->super->buf[ts_off + sizeof(uint32_t)])) = ts.counter;
+static void _pager_hash_remove(struct Pager* p, struct Block* b) {
+    struct Block** cur = &p->table[_pager_hash_idx(p, b->idx)];
+    while (*cur != b) {
+        cur = &(*cur)->hnext;
+    }
+    *cur = b->hnext;
+    b->hnext = NULL;
+    b->valid = false;
+}
+
+static void _pager_list_unlink(struct BlockList* l, struct Block* b) {
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        l->head = b->next;
+
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        l->tail = b->prev;
 
-    uint32_t to_end = _pager_file_size(db->idxf) - b->idx * BLOCK_SIZE;
-    _fseek(db->idxf, b->idx * BLOCK_SIZE, SEEK_SET);
-    _fwrite(b->buf, sizeof(char), to_end < BLOCK_SIZE ? to_end : BLOCK_SIZE, db->idxf);
+    b->prev = NULL;
+    b->next = NULL;
+    l->count--;
+}
 
-    b->dirty = false;
-    b->timestamp = ts;
+static void _pager_list_push_front(struct BlockList* l, struct Block* b) {
+    b->prev = NULL;
+    b->next = l->head;
+    if (l->head)
+        l->head->prev = b;
+    else
+        l->tail = b;
+    l->head = b;
+    l->count++;
 }
 
-static void _pager_read_into_block(struct DB* db, struct Block* b, uint32_t idx) {
-    uint32_t to_end = _pager_file_size(db->idxf) - idx * BLOCK_SIZE;
-    _fseek(db->idxf, idx * BLOCK_SIZE, SEEK_SET);
-    _fread(b->buf, sizeof(char), to_end < BLOCK_SIZE ? to_end : BLOCK_SIZE, db->idxf);
+static void _pager_list_push_back(struct BlockList* l, struct Block* b) {
+    b->next = NULL;
+    b->prev = l->tail;
+    if (l->tail)
+        l->tail->next = b;
+    else
+        l->head = b;
+    l->tail = b;
+    l->count++;
+}
 
-    b->dirty = false;
-    b->idx = idx;
+static struct BlockList* _pager_list_of(struct Pager* p, struct Block* b) {
+    switch (b->list) {
+        case BLOCK_LIST_HOT: return &p->hot;
+        case BLOCK_LIST_IN:  return &p->in;
+        default:             return &p->free;
+    }
+}
 
-    _fseek(db->idxf, SUPER_OFF + b->idx * sizeof(uint32_t) * 2, SEEK_SET);
-    _fread((void*)&b->timestamp.seconds, sizeof(uint32_t), 1, db->idxf);
-    _fread((void*)&b->timestamp.counter, sizeof(uint32_t), 1, db->idxf);
+static void _pager_list_move(struct Pager* p, struct Block* b, enum BlockListType to, bool front) {
+    _pager_list_unlink(_pager_list_of(p, b), b);
+    b->list = to;
+    if (front)
+        _pager_list_push_front(_pager_list_of(p, b), b);
+    else
+        _pager_list_push_back(_pager_list_of(p, b), b);
 }
 
-//uses least-recently used (LRU) eviction policy, and returns new block
-//linked list is rearranged so that this block is now most-recently used,
-//caller must set all fields with exception of 'next' field
-static struct Block* _pager_new_block(struct DB* db) {
-    struct Block* ret = db->blocks;
-    db->blocks = ret->next;
-    ret->next = NULL;
+inline static uint32_t _pager_ghost_hash(struct Pager* p, uint32_t blockidx) {
+    return (blockidx * 2654435761u) % p->ghost_max;
+}
 
-    struct Block* end = db->blocks;
-    while (end->next) {
-        end = end->next;
+//unlinks ring slot 'slot' from its hash chain, looking for the slot itself rather than its block
+//so that nothing but that slot can be unlinked
+static void _pager_ghost_unlink(struct Pager* p, uint32_t slot) {
+    uint32_t* cur = &p->ghost_table[_pager_ghost_hash(p, p->ghost_ids[slot])];
+    while (*cur != GHOST_NONE) {
+        if (*cur == slot) {
+            *cur = p->ghost_next[slot];
+            break;
+        }
+        cur = &p->ghost_next[*cur];
     }
-    end->next = ret;
+    p->ghost_ids[slot] = GHOST_NONE;
+}
 
-    return ret;
+static bool _pager_ghost_remove(struct Pager* p, uint32_t blockidx) {
+    uint32_t cur = p->ghost_table[_pager_ghost_hash(p, blockidx)];
+    for (; cur != GHOST_NONE; cur = p->ghost_next[cur]) {
+        if (p->ghost_ids[cur] == blockidx) {
+            _pager_ghost_unlink(p, cur);
+            return true;
+        }
+    }
+    return false;
 }
 
-static struct TimeStamp _pager_new_stamp(struct TimeStamp prev) {
-    struct TimeStamp new;
+//remembers a block evicted from the A1in queue, forgetting the oldest ghost if the ring is full
+//a block has at most one ghost, so an older one of the same block is dropped first
+static void _pager_ghost_add(struct Pager* p, uint32_t blockidx) {
+    _pager_ghost_remove(p, blockidx);
+    uint32_t slot = p->ghost_pos;
+    p->ghost_pos = (p->ghost_pos + 1) % p->ghost_max;
+    if (p->ghost_ids[slot] != GHOST_NONE)
+        _pager_ghost_unlink(p, slot);
 
-    new.seconds = time(NULL);
-    new.counter = new.seconds == prev.seconds ? prev.counter + 1 : 0;
+    uint32_t h = _pager_ghost_hash(p, blockidx);
+    p->ghost_ids[slot] = blockidx;
+    p->ghost_next[slot] = p->ghost_table[h];
+    p->ghost_table[h] = slot;
+}
 
-    return new;
+inline static uint32_t _pager_block_len(struct Pager* p, uint32_t idx) {
+    uint64_t off = (uint64_t)idx * BLOCK_SIZE;
+    if (off >= p->file_size)
+        return 0;
+    return p->file_size - off < BLOCK_SIZE ? p->file_size - off : BLOCK_SIZE;
 }
 
-//reload cache if stale
-//evict block (writing to disk if data is dirty) if more cache space needed
-//used by both pager_write and pager_read
-//NOTE: file should be write-locked!  Otherwise metadata in super block could be invalid
-static struct Block* _pager_prepare_block(struct DB* db, uint32_t idx) {
-    struct Block* b = _pager_find_block(db, idx);
-    if (b) {
-        if (_pager_block_is_stale(db->super, b)) {
-            _pager_read_into_block(db, b, idx);
+//maps the index file in MAP_EXTENT steps so that every byte of it is addressable
+//the mapping is read-only: changes reach the file through checkpoints
+//only called where the file changes size, so readers never see the mapping move
+static void _pager_map_cover(struct DB* db) {
+    struct Pager* p = db->pager;
+    if (p->file_size <= p->map_size)
+        return;
+
+    if (p->map)
+        munmap(p->map, p->map_size);
+
+    p->map_size = (p->file_size + MAP_EXTENT - 1) / MAP_EXTENT * MAP_EXTENT;
+    p->map = mmap(NULL, p->map_size, PROT_READ, MAP_SHARED, db->idxfd, 0);
+    if (p->map == MAP_FAILED)
+        err_quit("mmap failed");
+}
+
+static void _pager_set_file_size(struct DB* db, uint64_t size) {
+    db->pager->file_size = size;
+    if (db->pager->map_mode)
+        _pager_map_cover(db);
+}
+
+//replays logged changes onto a block read from the index file, returning true if some are pending
+//with a shared pool, the block as of the last commit published here is offered to other processes on the way
+static bool _pager_apply_log(struct DB* db, struct Block* b) {
+    if (!db->shared)
+        return wal_apply_block(db, b->idx, b->buf);
+
+    uint64_t lsn;
+    uint32_t len = wal_published(db, &lsn);
+    wal_apply_block_to(db, b->idx, b->buf, len);
+    shared_put(db, b->idx, b->buf, lsn);
+    return wal_apply_block_from(db, b->idx, b->buf, len);
+}
+
+//takes a block from the shared pool if it has an image the handle's log has nothing newer for
+static bool _pager_load_shared(struct DB* db, struct Block* b) {
+    uint64_t min_lsn, max_lsn;
+    if (!wal_image_range(db, b->idx, &min_lsn, &max_lsn) || !shared_get(db, b->idx, b->buf, min_lsn, max_lsn))
+        return false;
+
+    b->dirty = wal_apply_pending(db, b->idx, b->buf);
+    return true;
+}
+
+//loads blocks from the index file, or copies them from the mapping, zero fills anything past the end of the file
+//and then replays logged changes on top
+//'blocks' (at most PAGER_IOV_MAX) are in index order: each run of consecutive ones is one vectored read,
+//and the runs are submitted together
+static void _pager_read_blocks(struct DB* db, struct Block** blocks, uint32_t count) {
+    struct Pager* p = db->pager;
+    struct iovec iov[PAGER_IOV_MAX];
+    struct IoBatch batch;
+    batch.count = 0;
+    bool joins = false; //the previous block was read in full, by the last op of the batch
+    for (uint32_t i = 0; i < count; i++) {
+        struct Block* b = blocks[i];
+        iov[i].iov_base = b->buf;
+        iov[i].iov_len = _pager_block_len(p, b->idx);
+        if (!iov[i].iov_len || p->map_mode) {
+            if (iov[i].iov_len)
+                memcpy(b->buf, p->map + (size_t)b->idx * BLOCK_SIZE, iov[i].iov_len);
+            joins = false;
+            continue;
+        }
+
+        if (joins && blocks[i - 1]->idx + 1 == b->idx) {
+            batch.ops[batch.count - 1].iov_count++;
+        } else {
+            io_batch_add(&batch, db->idxfd, false, &iov[i], 1, (uint64_t)b->idx * BLOCK_SIZE);
+        }
+        joins = iov[i].iov_len == BLOCK_SIZE;
+    }
+    io_batch_run(&batch, p->async_io);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (iov[i].iov_len < BLOCK_SIZE)
+            memset(blocks[i]->buf + iov[i].iov_len, 0, BLOCK_SIZE - iov[i].iov_len);
+        blocks[i]->dirty = _pager_apply_log(db, blocks[i]);
+    }
+}
+
+//loads blocks (at most PAGER_IOV_MAX, in index order), taking those the shared pool has from there
+//and reading the rest together
+static void _pager_read_into_blocks(struct DB* db, struct Block** blocks, uint32_t count) {
+    struct Block* rest[PAGER_IOV_MAX];
+    uint32_t rest_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(db->shared && _pager_load_shared(db, blocks[i])))
+            rest[rest_count++] = blocks[i];
+    }
+
+    if (rest_count)
+        _pager_read_blocks(db, rest, rest_count);
+}
+
+//builds a block as the calling thread's snapshot sees it, outside the cache
+//the index file holds the block as of the last checkpoint, which cannot run while the snapshot is held
+static void _pager_read_snapshot(struct DB* db, uint32_t idx, char* buf) {
+    struct Pager* p = db->pager;
+    uint32_t len = _pager_block_len(p, idx);
+    if (p->map_mode)
+        memcpy(buf, p->map + (size_t)idx * BLOCK_SIZE, len);
+    else
+        len = _pread(db->idxfd, buf, len, (off_t)idx * BLOCK_SIZE);
+    memset(buf + len, 0, BLOCK_SIZE - len);
+    wal_apply_block_to(db, idx, buf, _pager_snapshot);
+}
+
+static struct Block* _pager_list_victim(struct BlockList* l) {
+    struct Block* b = l->tail;
+    while (b && __atomic_load_n(&b->pins, __ATOMIC_ACQUIRE)) {
+        b = b->prev;
+    }
+    return b;
+}
+
+//picks an unpinned frame to reuse: free frames first, then the A1in tail once A1in is over its share (2Q),
+//and otherwise the least-recently used hot block
+//victim is removed from the hash table and returned pinned on the free list
+//if every frame is pinned, waits for one to be unpinned if 'wait' is set, and returns NULL otherwise -
+//only a thread holding no pins of its own waits, so the pins it waits on are always released
+//NOTE: list_lock should be held
+static struct Block* _pager_new_block(struct DB* db, bool wait) {
+    struct Pager* p = db->pager;
+    bool waiting = false;
+
+    for (;;) {
+        struct Block* ret;
+        bool ghost = false;
+        if (!(ret = _pager_list_victim(&p->free))) {
+            struct Block* in = _pager_list_victim(&p->in);
+            struct Block* hot = _pager_list_victim(&p->hot);
+            if (in && (p->in.count > p->in_max || !hot)) {
+                ret = in;
+                ghost = !ret->scan;
+            } else {
+                ret = hot;
+            }
+        }
+
+        if (!ret) {
+            if (!wait)
+                return NULL;
+            //the frames are looked over once more after the wait is announced, so an unpin in between is not missed
+            if (waiting)
+                pthread_cond_wait(&p->frame_freed, &p->list_lock);
+            else
+                __atomic_add_fetch(&p->frame_waiters, 1, __ATOMIC_SEQ_CST);
+            waiting = true;
+            continue;
+        }
+
+        if (ret->valid) {
+            //pins are raised under the shard lock, so an unpinned block can be unhooked there safely
+            pthread_mutex_t* shard = _pager_shard(p, ret->idx);
+            pthread_mutex_lock(shard);
+            if (__atomic_load_n(&ret->pins, __ATOMIC_ACQUIRE)) {
+                pthread_mutex_unlock(shard);
+                _pager_list_move(p, ret, ret->list, true);
+                continue;
+            }
+            _pager_hash_remove(p, ret);
+            pthread_mutex_unlock(shard);
         }
+
+        if (ghost)
+            _pager_ghost_add(p, ret->idx);
+        _pager_list_move(p, ret, BLOCK_LIST_FREE, false);
+        ret->pins = 1;
+        if (waiting)
+            __atomic_sub_fetch(&p->frame_waiters, 1, __ATOMIC_SEQ_CST);
+        return ret;
+    }
+}
+
+//puts a newly loaded block on a replacement list
+//scan loads go to the cold end so they are the next victims and never displace the hot set
+//a loaded block's ghost is dropped either way, as it is cached again
+//NOTE: list_lock should be held
+static void _pager_place_block(struct Pager* p, struct Block* b) {
+    b->scan = _pager_hint == PAGER_HINT_SCAN;
+    bool ghost = _pager_ghost_remove(p, b->idx);
+    if (p->policy == DB_CACHE_LRU) {
+        _pager_list_move(p, b, BLOCK_LIST_HOT, !b->scan);
+    } else if (!b->scan && ghost) {
+        _pager_list_move(p, b, BLOCK_LIST_HOT, true);
     } else {
-        b = _pager_new_block(db);
-        if (b->dirty) {
-            struct TimeStamp ts = _pager_new_stamp(b->timestamp);
-            _pager_write_from_block(db, b, ts);
-            struct TimeStamp mts = _pager_new_stamp(db->super->timestamp); 
-            _pager_write_from_block(db, db->super, mts);
+        _pager_list_move(p, b, BLOCK_LIST_IN, !b->scan);
+    }
+}
+
+//updates replacement state on a cache hit
+//NOTE: list_lock should be held
+static void _pager_touch_block(struct Pager* p, struct Block* b) {
+    if (_pager_hint == PAGER_HINT_SCAN)
+        return;
+
+    if (b->scan) {
+        //first real use of a block brought in by a scan counts as its first reference
+        b->scan = false;
+        _pager_list_move(p, b, b->list, true);
+    } else if (b->list == BLOCK_LIST_HOT && b != p->hot.head) {
+        _pager_list_move(p, b, BLOCK_LIST_HOT, true);
+    }
+}
+
+//returns the frame holding block 'idx', pinned
+//on a miss the frame is new, in the table, latched for writing and still to be loaded, and 'miss' is set
+//a thread that loses the race to insert the same block gives its frame back and uses the winner's
+//returns NULL if there is no frame for it and 'wait' is not set, see _pager_new_block
+static struct Block* _pager_get_block(struct DB* db, uint32_t idx, bool* miss, bool wait) {
+    struct Pager* p = db->pager;
+    pthread_mutex_t* shard = _pager_shard(p, idx);
+    *miss = false;
+
+    pthread_mutex_lock(shard);
+    struct Block* b = _pager_find_block(db, idx);
+    if (b) {
+        _pager_pin(b);
+        pthread_mutex_unlock(shard);
+        //a scan's touches change nothing, so it leaves the list lock alone
+        if (_pager_hint != PAGER_HINT_SCAN && !pthread_mutex_trylock(&p->list_lock)) {
+            _pager_touch_block(p, b);
+            pthread_mutex_unlock(&p->list_lock);
         }
-        _pager_read_into_block(db, b, idx);
+        return b;
+    }
+    pthread_mutex_unlock(shard);
+
+    pthread_mutex_lock(&p->list_lock);
+    struct Block* nb = _pager_new_block(db, wait);
+    pthread_mutex_unlock(&p->list_lock);
+    if (!nb)
+        return NULL;
+
+    //no one else can reach the new frame yet, so it is never latched
+    if (pthread_rwlock_trywrlock(&nb->latch))
+        err_quit("frame latched while unpinned");
+    pthread_mutex_lock(shard);
+    if ((b = _pager_find_block(db, idx))) {
+        _pager_pin(b);
+        pthread_mutex_unlock(shard);
+        pthread_rwlock_unlock(&nb->latch);
+        _pager_unpin(p, nb);
+        return b;
+    }
+    nb->idx = idx;
+    _pager_hash_insert(p, nb);
+    pthread_mutex_unlock(shard);
+
+    pthread_mutex_lock(&p->list_lock);
+    _pager_place_block(p, nb);
+    pthread_mutex_unlock(&p->list_lock);
+
+    *miss = true;
+    return nb;
+}
+
+//takes a pinned frame out of the table, so the next lookup of its block loads a new one
+//it goes to the free list, to be reused once the last pin is gone
+static void _pager_detach(struct DB* db, struct Block* b) {
+    struct Pager* p = db->pager;
+    pthread_mutex_lock(&p->list_lock);
+    pthread_mutex_t* shard = _pager_shard(p, b->idx);
+    pthread_mutex_lock(shard);
+    if (b->valid) {
+        _pager_hash_remove(p, b);
+        _pager_list_move(p, b, BLOCK_LIST_FREE, false);
+    }
+    pthread_mutex_unlock(shard);
+    pthread_mutex_unlock(&p->list_lock);
+}
+
+//loads new frames and lets threads waiting on them in
+static void _pager_load(struct DB* db, struct Block** misses, uint32_t count) {
+    _pager_read_into_blocks(db, misses, count);
+    for (uint32_t i = 0; i < count; i++) {
+        pthread_rwlock_unlock(&misses[i]->latch);
+    }
+}
+
+//finds or loads up to 'count' consecutive blocks starting at idx_start and pins them in 'out'
+//the misses are read together once all the blocks are pinned, with a single preadv for misses next to each other
+//evicted blocks are never written: committed changes are in the log and can be replayed
+//used by both pager_write and pager_read
+//a block being loaded by another thread is pinned without waiting; its latch is waited on when it is copied
+//the first block may wait for a frame, the others stop short when every frame is pinned
+//NOTE: the calling thread should hold no pins
+//returns the number of blocks pinned, at least one
+static uint32_t _pager_prepare_blocks(struct DB* db, uint32_t idx_start, uint32_t count, struct Block** out) {
+    struct Block* misses[PAGER_IOV_MAX];
+    uint32_t miss_count = 0;
+
+    uint32_t i = 0;
+    for (; i < count; i++) {
+        bool miss;
+        if (!(out[i] = _pager_get_block(db, idx_start + i, &miss, i == 0)))
+            break;
+        if (miss)
+            misses[miss_count++] = out[i];
+    }
+
+    if (miss_count)
+        _pager_load(db, misses, miss_count);
+    return i;
+}
+
+//maps an anonymous arena for frame buffers, falling back to normal pages if no huge pages are available
+static char* _pager_map_arena(size_t* size, bool* huge_pages) {
+    void* ptr = MAP_FAILED;
+    if (*huge_pages) {
+        size_t huge_size = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        ptr = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED)
+            *size = huge_size;
+    }
+
+    if (ptr == MAP_FAILED) {
+        *huge_pages = false;
+        ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            err_quit("mmap failed");
+    }
+
+    return ptr;
+}
+
+static uint32_t _pager_frames_for(uint64_t cache_bytes) {
+    uint64_t frames = cache_bytes / BLOCK_SIZE;
+    if (frames < BLOCKS_MIN)
+        frames = BLOCKS_MIN;
+    if (frames > UINT32_MAX / 2)
+        frames = UINT32_MAX / 2;
+    return frames;
+}
+
+//sets up frames and hash table for frame_count frames, with all frames empty and on the LRU list
+static void _pager_init_frames(struct Pager* p, uint32_t frame_count) {
+    p->frame_count = frame_count;
+    p->arena_size = (size_t)frame_count * BLOCK_SIZE;
+    p->arena = _pager_map_arena(&p->arena_size, &p->huge_pages);
+    p->frames = _calloc(p->frame_count, sizeof(struct Block));
+
+    uint32_t table_size = 1;
+    while (table_size < p->frame_count * 2) {
+        table_size <<= 1;
+    }
+    p->table = _calloc(table_size, sizeof(struct Block*));
+    p->table_mask = table_size - 1;
+
+    p->free = (struct BlockList){ NULL, NULL, 0 };
+    p->hot = (struct BlockList){ NULL, NULL, 0 };
+    p->in = (struct BlockList){ NULL, NULL, 0 };
+    for (uint32_t i = 0; i < p->frame_count; i++) {
+        p->frames[i].buf = p->arena + (size_t)i * BLOCK_SIZE;
+        p->frames[i].list = BLOCK_LIST_FREE;
+        pthread_rwlock_init(&p->frames[i].latch, NULL);
+        _pager_list_push_back(&p->free, &p->frames[i]);
+    }
+
+    //2Q sizing: A1in holds a quarter of the frames, A1out remembers half as many blocks as there are frames
+    p->in_max = p->frame_count / 4;
+    p->ghost_max = p->frame_count / 2;
+    p->ghost_pos = 0;
+    p->ghost_ids = _malloc(p->ghost_max * sizeof(uint32_t));
+    p->ghost_next = _malloc(p->ghost_max * sizeof(uint32_t));
+    p->ghost_table = _malloc(p->ghost_max * sizeof(uint32_t));
+    memset(p->ghost_ids, 0xff, p->ghost_max * sizeof(uint32_t));
+    memset(p->ghost_table, 0xff, p->ghost_max * sizeof(uint32_t));
+}
+
+static void _pager_free_frames(struct Pager* p) {
+    for (uint32_t i = 0; i < p->frame_count; i++) {
+        pthread_rwlock_destroy(&p->frames[i].latch);
+    }
+    munmap(p->arena, p->arena_size);
+    free(p->frames);
+    free(p->table);
+    free(p->ghost_ids);
+    free(p->ghost_next);
+    free(p->ghost_table);
+}
+
+void pager_open(struct DB* db, uint64_t cache_bytes, bool huge_pages, enum DbCachePolicy policy, bool map_mode, bool async_io) {
+    struct Pager* p = _calloc(1, sizeof(struct Pager));
+    p->huge_pages = huge_pages;
+    p->policy = policy;
+    p->map_mode = map_mode;
+    p->async_io = async_io;
+    p->checkpoint_size = WAL_CHECKPOINT_SIZE;
+    for (int i = 0; i < PAGER_SHARDS; i++) {
+        pthread_mutex_init(&p->shards[i], NULL);
+    }
+    pthread_mutex_init(&p->list_lock, NULL);
+    pthread_cond_init(&p->frame_freed, NULL);
+    _pager_init_frames(p, _pager_frames_for(cache_bytes));
+
+    db->pager = p;
+    _pager_set_file_size(db, _file_size(db->idxfd));
+}
+
+void pager_close(struct DB* db) {
+    struct Pager* p = db->pager;
+    if (p->map)
+        munmap(p->map, p->map_size);
+    _pager_free_frames(p);
+    for (int i = 0; i < PAGER_SHARDS; i++) {
+        pthread_mutex_destroy(&p->shards[i]);
+    }
+    pthread_mutex_destroy(&p->list_lock);
+    pthread_cond_destroy(&p->frame_freed);
+    free(p);
+}
+
+//copies blocks from an old replacement list into the same list of the new pool, in the same order
+//returns the number of frames still free in the new pool
+//blocks that do not fit are dropped, since they can be rebuilt from the file and the log
+static uint32_t _pager_copy_list(struct Pager* p, struct BlockList* from, enum BlockListType to, uint32_t room) {
+    for (struct Block* cur = from->head; cur && room; cur = cur->next) {
+        struct Block* b = p->free.head;
+        memcpy(b->buf, cur->buf, BLOCK_SIZE);
+        b->idx = cur->idx;
+        b->dirty = cur->dirty;
+        b->scan = cur->scan;
+        _pager_hash_insert(p, b);
+        _pager_list_move(p, b, to, false);
+        room--;
+    }
+
+    return room;
+}
+
+//rebuilds the pool with a new frame count, keeping hot blocks cached first and then A1in blocks
+void pager_resize(struct DB* db, uint64_t cache_bytes) {
+    struct Pager* p = db->pager;
+    struct Pager old = *p;
+    _pager_init_frames(p, _pager_frames_for(cache_bytes));
+
+    uint32_t room = _pager_copy_list(p, &old.hot, BLOCK_LIST_HOT, p->frame_count);
+    _pager_copy_list(p, &old.in, BLOCK_LIST_IN, room);
+
+    _pager_free_frames(&old);
+}
+
+//sets the hint for the calling thread's touches, returning the one it replaces so that it can be put back
+enum PagerHint pager_hint(struct DB* db, enum PagerHint hint) {
+    (void)db;
+    enum PagerHint prev = _pager_hint;
+    _pager_hint = hint;
+    return prev;
+}
+
+//reads by the calling thread see the database as it is now, until pager_snapshot_end, and never
+//the pending changes of a writer: a cached block is read if it is clean and unchanged since the
+//snapshot, and is rebuilt from the index file and the log prefix otherwise
+//returns false if the handle has to catch up with a checkpoint first
+//NOTE: snapshot lock should be held
+bool pager_snapshot_begin(struct DB* db) {
+    if (wal_snapshot(db, &_pager_snapshot))
+        return true;
+
+    _pager_snapshot = PAGER_NO_SNAPSHOT;
+    return false;
+}
+
+void pager_snapshot_end(struct DB* db) {
+    (void)db;
+    _pager_snapshot = PAGER_NO_SNAPSHOT;
+}
+
+//copies part of a block for a snapshot read
+static void _pager_copy_snapshot(struct DB* db, struct Block* b, char* dst, uint32_t start, uint32_t len) {
+    pthread_rwlock_rdlock(&b->latch);
+    if (!b->dirty && !wal_changed_since(db, b->idx, _pager_snapshot)) {
+        memcpy(dst, b->buf + start, len);
+        pthread_rwlock_unlock(&b->latch);
+        return;
     }
+    pthread_rwlock_unlock(&b->latch);
 
+    char block[BLOCK_SIZE];
+    _pager_read_snapshot(db, b->idx, block);
+    memcpy(dst, block + start, len);
+}
+
+//write-latches the frame of a block about to be changed, swapping it for a new one while it has views
+//the new frame is loaded from the file and the log, which already hold the change being made
+//this is the one place a thread may wait for a frame holding pins (the rest of its chunk), which views
+//holding no more than their share of the pool leaves room for
+static struct Block* _pager_latch_writable(struct DB* db, struct Block* b) {
+    pthread_rwlock_wrlock(&b->latch);
+    while (__atomic_load_n(&b->views, __ATOMIC_ACQUIRE)) {
+        uint32_t idx = b->idx;
+        pthread_rwlock_unlock(&b->latch);
+        _pager_detach(db, b);
+        _pager_unpin(db->pager, b);
+        _pager_prepare_blocks(db, idx, 1, &b);
+        pthread_rwlock_wrlock(&b->latch);
+    }
     return b;
 }
 
-void pager_write(struct DB* db, uint32_t file_off, char* buf, uint32_t len) {
-    uint32_t idx_start = _pager_off_to_idx(file_off);
+//copies between 'buf' and the cache in chunks (see _pager_chunk) so a request never pins the whole pool
+//in mmap mode, reads of blocks without logged changes come straight from the mapping instead
+static void _pager_copy(struct DB* db, uint64_t file_off, char* buf, uint32_t len, bool write) {
+    struct Pager* p = db->pager;
+    struct Block* blocks[PAGER_IOV_MAX];
+    uint32_t idx = _pager_off_to_idx(file_off);
     uint32_t idx_end = _pager_off_to_idx(file_off + len - 1);
+    if (idx_end > idx)
+        __atomic_add_fetch(&p->pinners, 1, __ATOMIC_ACQ_REL);
 
-    uint32_t bytes_written = 0;
-    for (int i = idx_start; i <= idx_end; i++) {
-        struct Block* b = _pager_prepare_block(db, i);
+    uint32_t bytes_done = 0;
+    while (idx <= idx_end) {
+        uint32_t chunk = _pager_chunk(p);
+        uint32_t count = idx_end - idx + 1 < chunk ? idx_end - idx + 1 : chunk;
+        bool direct = p->map_mode && !write && (uint64_t)(idx + 1) * BLOCK_SIZE <= p->file_size && !wal_has_block(db, idx);
+        if (direct) {
+            count = 1;
+        } else {
+            count = _pager_prepare_blocks(db, idx, count, blocks);
+        }
 
-        //block buffer offset to read from
-        uint32_t block_left_off = b->idx * BLOCK_SIZE;
-        uint32_t block_start = 0;
-        if (file_off > block_left_off) {
-            block_start = file_off - block_left_off;
+        for (uint32_t i = 0; i < count; i++) {
+            //block buffer offset to copy from
+            uint64_t block_left_off = (uint64_t)(idx + i) * BLOCK_SIZE;
+            uint32_t block_start = 0;
+            if (file_off > block_left_off) {
+                block_start = file_off - block_left_off;
+            }
+
+            //length to copy
+            uint32_t bytes_to_copy = len - bytes_done < BLOCK_SIZE - block_start ? len - bytes_done : BLOCK_SIZE - block_start;
+
+            if (direct) {
+                memcpy(&buf[bytes_done], p->map + (size_t)block_left_off + block_start, bytes_to_copy);
+            } else if (write) {
+                struct Block* b = _pager_latch_writable(db, blocks[i]);
+                memcpy(&b->buf[block_start], &buf[bytes_done], bytes_to_copy);
+                b->dirty = true;
+                pthread_rwlock_unlock(&b->latch);
+                _pager_unpin(p, b);
+            } else if (_pager_snapshot != PAGER_NO_SNAPSHOT) {
+                _pager_copy_snapshot(db, blocks[i], &buf[bytes_done], block_start, bytes_to_copy);
+                _pager_unpin(p, blocks[i]);
+            } else {
+                pthread_rwlock_rdlock(&blocks[i]->latch);
+                memcpy(&buf[bytes_done], &blocks[i]->buf[block_start], bytes_to_copy);
+                pthread_rwlock_unlock(&blocks[i]->latch);
+                _pager_unpin(p, blocks[i]);
+            }
+            bytes_done += bytes_to_copy;
         }
 
-        //length to read
-        uint32_t bytes_to_read = len - bytes_written < BLOCK_SIZE - block_start ? len - bytes_written : BLOCK_SIZE - block_start;
+        idx += count;
+    }
+    if (idx_end > _pager_off_to_idx(file_off))
+        __atomic_sub_fetch(&p->pinners, 1, __ATOMIC_ACQ_REL);
+}
+
+void pager_write(struct DB* db, uint64_t file_off, char* buf, uint32_t len) {
+    wal_log(db, file_off, buf, len);
+    _pager_copy(db, file_off, buf, len, true);
+}
 
-        memcpy(&b->buf[block_start], &buf[bytes_written], bytes_to_read);
-        bytes_written += bytes_to_read;
-        b->dirty = true;
+void pager_read(struct DB* db, uint64_t file_off, char* buf, uint32_t len) {
+    _pager_copy(db, file_off, buf, len, false);
+}
+
+//returns a pointer to [file_off, file_off + len) in the cached block holding it, which stays pinned (and
+//unchanged) until pager_view_release - or NULL if the bytes span two blocks, the frame does not hold them
+//as the thread's snapshot sees them, or views already pin PAGER_VIEW_SHARE of the pool, in which case
+//they have to be copied with pager_read
+const char* pager_view(struct DB* db, uint64_t file_off, uint32_t len, struct Block** frame) {
+    struct Pager* p = db->pager;
+    uint32_t idx = _pager_off_to_idx(file_off);
+    if (len && _pager_off_to_idx(file_off + len - 1) != idx)
+        return NULL;
+
+    //views are held for as long as the caller likes, so they must leave the rest of the pool to other pins
+    if (__atomic_add_fetch(&p->view_pins, 1, __ATOMIC_ACQ_REL) > p->frame_count / PAGER_VIEW_SHARE) {
+        __atomic_sub_fetch(&p->view_pins, 1, __ATOMIC_ACQ_REL);
+        return NULL;
     }
+
+    struct Block* b;
+    _pager_prepare_blocks(db, idx, 1, &b);
+    pthread_rwlock_rdlock(&b->latch);
+    if (_pager_snapshot != PAGER_NO_SNAPSHOT && (b->dirty || wal_changed_since(db, idx, _pager_snapshot))) {
+        pthread_rwlock_unlock(&b->latch);
+        _pager_unpin(p, b);
+        __atomic_sub_fetch(&p->view_pins, 1, __ATOMIC_ACQ_REL);
+        return NULL;
+    }
+    __atomic_add_fetch(&b->views, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&b->latch);
+
+    *frame = b;
+    return b->buf + file_off % BLOCK_SIZE;
 }
 
-void pager_read(struct DB* db, uint32_t file_off, char* buf, uint32_t len) {
-    uint32_t idx_start = _pager_off_to_idx(file_off);
-    uint32_t idx_end = _pager_off_to_idx(file_off + len - 1);
+void pager_view_release(struct DB* db, struct Block* frame) {
+    __atomic_sub_fetch(&frame->views, 1, __ATOMIC_ACQ_REL);
+    __atomic_sub_fetch(&db->pager->view_pins, 1, __ATOMIC_ACQ_REL);
+    _pager_unpin(db->pager, frame);
+}
+
+//brings the cache up to date with changes committed by other processes
+//NOTE: file should be locked
+void pager_begin(struct DB* db) {
+    wal_catch_up(db);
+}
+
+//copies every block changed since the last checkpoint into the index file, in file order and
+//batched into pwritev runs submitted together, then starts a new log generation
+//the log is made durable first so a crash part way through can always be repaired by replaying it
+//snapshots are built on the index file as it is, so this waits for readers in this process and is put off
+//(returning false) while readers in other processes hold snapshots - until the log is twice the checkpoint
+//size, when it waits for them as well
+//NOTE: file should be write-locked, with no pending changes
+bool pager_checkpoint(struct DB* db) {
+    struct Pager* p = db->pager;
+    if (!lock_snapshots(db, wal_size(db) > 2 * WAL_CHECKPOINT_SIZE))
+        return false;
+    wal_flush(db);
+
+    //the heap grows by whole extents, so the file is extended the same way before blocks are written into it
+    //and it is cut back once a compaction has moved the heap end down - blocks past the end hold nothing live
+    uint32_t heap_end;
+    pager_read(db, HEAP_END_OFF, &heap_end, sizeof(uint32_t));
+    uint32_t keep_blocks = ((uint64_t)heap_end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (heap_end > p->file_size) {
+        _fallocate(db->idxfd, p->file_size, heap_end - p->file_size);
+        _pager_set_file_size(db, heap_end);
+    }
+
+    uint32_t count;
+    uint32_t* blocks = wal_blocks(db, &count);
+    while (count && blocks[count - 1] >= keep_blocks) {
+        count--;
+    }
+    char* scratch = _malloc(PAGER_CHECKPOINT_BLOCKS * BLOCK_SIZE);
+    struct Block* tmp = _malloc(PAGER_CHECKPOINT_BLOCKS * sizeof(struct Block));
+    struct iovec iov[PAGER_CHECKPOINT_BLOCKS];
+
+    //blocks go out in batches of runs, a pwritev per run of consecutive blocks, each batch submitted together
+    //blocks that are not cached are built in 'scratch' first, PAGER_IOV_MAX at a time
+    uint32_t i = 0;
+    while (i < count) {
+        struct IoBatch batch;
+        batch.count = 0;
+        struct Block* build[PAGER_IOV_MAX];
+        uint32_t build_count = 0;
+        uint32_t n = 0;
+        while (i < count && n < PAGER_CHECKPOINT_BLOCKS && batch.count < IO_BATCH_MAX) {
+            uint32_t run = 0;
+            while (i + run < count && n + run < PAGER_CHECKPOINT_BLOCKS && run < PAGER_IOV_MAX &&
+                   blocks[i + run] == blocks[i] + run) {
+                struct Block* b = _pager_find_block(db, blocks[i + run]);
+                if (!b) {
+                    b = &tmp[n + run];
+                    memset(b, 0, sizeof(struct Block));
+                    b->buf = scratch + (size_t)(n + run) * BLOCK_SIZE;
+                    b->idx = blocks[i + run];
+                    build[build_count++] = b;
+                    if (build_count == PAGER_IOV_MAX) {
+                        _pager_read_into_blocks(db, build, build_count);
+                        build_count = 0;
+                    }
+                }
+                iov[n + run].iov_base = b->buf;
+                iov[n + run].iov_len = BLOCK_SIZE;
+                run++;
+            }
+
+            io_batch_add(&batch, db->idxfd, true, &iov[n], run, (uint64_t)blocks[i] * BLOCK_SIZE);
+            n += run;
+            i += run;
+        }
+        if (build_count)
+            _pager_read_into_blocks(db, build, build_count);
+
+        io_batch_run(&batch, p->async_io);
+        if ((uint64_t)(blocks[i - 1] + 1) * BLOCK_SIZE > p->file_size)
+            _pager_set_file_size(db, (uint64_t)(blocks[i - 1] + 1) * BLOCK_SIZE);
+    }
+
+    if ((uint64_t)keep_blocks * BLOCK_SIZE < p->file_size) {
+        _ftruncate(db->idxfd, (uint64_t)keep_blocks * BLOCK_SIZE);
+        _pager_set_file_size(db, (uint64_t)keep_blocks * BLOCK_SIZE);
+    }
+
+    _fdatasync(db->idxfd);
+    p->checkpoint_written += (uint64_t)count * BLOCK_SIZE;
+    free(tmp);
+    free(scratch);
+    free(blocks);
+
+    wal_reset(db);
+    unlock_snapshots(db);
+    return true;
+}
+
+//makes the changes of the current operation durable (once wal_sync runs) and visible to other processes
+//NOTE: file should be write-locked
+//writers sharing the file append under the log lock and leave checkpoints to the next whole-file lock holder
+void pager_commit(struct DB* db) {
+    if (wal_pending(db)) {
+        lock_log(db); //released with the operation's other locks
+        wal_commit(db);
+    }
+    if (db->lock_mode != DB_LOCK_SHARED && wal_size(db) > db->pager->checkpoint_size)
+        pager_checkpoint(db);
+}
+
+//throws away the changes of the current operation: blocks holding them are dropped from the cache
+//and will be reloaded without them
+void pager_abort(struct DB* db) {
+    wal_abort(db);
+}
+
+//true if the heap can grow by 'len' bytes
+//file offsets are 64-bit, but records, nodes and the super block hold 32-bit heap offsets, so the heap
+//(and with it the index file) stops at 4 GB
+bool pager_heap_room(struct DB* db, uint64_t len) {
+    uint32_t end;
+    pager_read(db, HEAP_END_OFF, (char*)&end, sizeof(uint32_t));
+    return len <= UINT32_MAX - end;
+}
+
+//extends the heap by 'len' bytes and returns the offset of the new space
+//the end of the heap is kept in the super block so growth is logged like any other change;
+//the index file itself only grows when blocks past its end are checkpointed
+//writes check for room before they change anything (see table_has_room), so a full heap never gets here
+uint32_t pager_grow(struct DB* db, uint32_t len) {
+    uint32_t end;
+    pager_read(db, HEAP_END_OFF, (char*)&end, sizeof(uint32_t));
+    if (len > UINT32_MAX - end)
+        err_quit("database file is full");
+    uint32_t new_end = end + len;
+    pager_write(db, HEAP_END_OFF, (char*)&new_end, sizeof(uint32_t));
+    return end;
+}
+
+//returns the cached block pinned, or NULL if it is not cached
+static struct Block* _pager_pin_cached(struct DB* db, uint32_t idx) {
+    pthread_mutex_t* shard = _pager_shard(db->pager, idx);
+    pthread_mutex_lock(shard);
+    struct Block* b = _pager_find_block(db, idx);
+    if (b)
+        _pager_pin(b);
+    pthread_mutex_unlock(shard);
+    return b;
+}
 
-    uint32_t bytes_written = 0;
-    for (int i = idx_start; i <= idx_end; i++) {
-        struct Block* b = _pager_prepare_block(db, i);
+//asks the kernel to start reading blocks a scan will soon need, unless the first of them is cached already
+//only a hint: a block past the end of the index file, or with logged changes, is still built when it is read
+void pager_prefetch(struct DB* db, uint64_t file_off, uint32_t len) {
+    struct Pager* p = db->pager;
+    uint32_t idx = _pager_off_to_idx(file_off);
+    struct Block* b = _pager_pin_cached(db, idx);
+    if (b) {
+        _pager_unpin(p, b);
+        return;
+    }
+
+    uint64_t start = (uint64_t)idx * BLOCK_SIZE;
+    uint64_t end = file_off + len < p->file_size ? file_off + len : p->file_size;
+    if (start >= end)
+        return;
+    if (p->map_mode)
+        madvise(p->map + start, end - start, MADV_WILLNEED);
+    else
+        posix_fadvise(db->idxfd, start, end - start, POSIX_FADV_WILLNEED);
+}
 
-        //block buffer offset to read from
-        uint32_t block_left_off = b->idx * BLOCK_SIZE;
-        uint32_t block_start = 0;
-        if (file_off > block_left_off) {
-            block_start = file_off - block_left_off;
+static int _pager_range_cmp(const void* a, const void* b) {
+    const struct PagerRange* x = a;
+    const struct PagerRange* y = b;
+    if (x->off != y->off)
+        return x->off < y->off ? -1 : 1;
+    return x->tag < y->tag ? -1 : x->tag > y->tag;
+}
+
+//sorts ranges into file order, those at the same offset by tag
+void pager_sort_ranges(struct PagerRange* ranges, uint32_t count) {
+    qsort(ranges, count, sizeof(struct PagerRange), _pager_range_cmp);
+}
+
+//brings the blocks of a run of ranges (in file order) into the cache, reading all the missing ones together:
+//runs of consecutive blocks with one vectored read each, and the runs submitted as one batch
+//takes the ranges from the front for as long as their blocks fit in what one request may pin, and returns how
+//many it took - at least one, even if only the first blocks of it fit - so the caller reads those before loading
+//the next run, and nothing it loaded has been evicted in the meantime
+//in mmap mode blocks without logged changes are read from the mapping, so the kernel is only asked to start on them
+uint32_t pager_load(struct DB* db, const struct PagerRange* ranges, uint32_t count) {
+    struct Pager* p = db->pager;
+    if (p->map_mode) {
+        for (uint32_t i = 0; i < count; i++) {
+            pager_prefetch(db, ranges[i].off, ranges[i].len);
         }
+        return count;
+    }
+
+    struct Block* blocks[PAGER_IOV_MAX];
+    struct Block* misses[PAGER_IOV_MAX];
+    __atomic_add_fetch(&p->pinners, 1, __ATOMIC_ACQ_REL);
+    uint32_t chunk = _pager_chunk(p);
+    uint32_t block_count = 0;
+    uint32_t miss_count = 0;
+    uint32_t last = UINT32_MAX;
+    uint32_t taken = 0;
+    bool full = false;
+    for (; taken < count && !full; taken++) {
+        uint32_t idx = _pager_off_to_idx(ranges[taken].off);
+        uint32_t idx_end = _pager_off_to_idx(ranges[taken].off + (ranges[taken].len ? ranges[taken].len - 1 : 0));
+        if (last != UINT32_MAX && idx <= last)
+            idx = last + 1; //shares its first block with the range before
+        if (taken && idx <= idx_end && block_count + (idx_end - idx + 1) > chunk)
+            break;
+
+        //only the first block waits for a frame, as in _pager_prepare_blocks
+        for (; idx <= idx_end && block_count < chunk; idx++) {
+            bool miss;
+            if (!(blocks[block_count] = _pager_get_block(db, idx, &miss, block_count == 0))) {
+                full = true;
+                break;
+            }
+            if (miss)
+                misses[miss_count++] = blocks[block_count];
+            block_count++;
+            last = idx;
+        }
+    }
 
-        //length to read
-        uint32_t bytes_to_read = len - bytes_written < BLOCK_SIZE - block_start ? len - bytes_written : BLOCK_SIZE - block_start;
+    if (miss_count)
+        _pager_load(db, misses, miss_count);
+    for (uint32_t i = 0; i < block_count; i++) {
+        _pager_unpin(p, blocks[i]);
+    }
+    __atomic_sub_fetch(&p->pinners, 1, __ATOMIC_ACQ_REL);
+    return taken;
+}
+
+//called by the log for each record committed by another process
+void pager_patch(struct DB* db, uint64_t file_off, const char* buf, uint32_t len) {
+    struct Block* b = _pager_pin_cached(db, _pager_off_to_idx(file_off));
+    if (b) {
+        pthread_rwlock_wrlock(&b->latch);
+        if (__atomic_load_n(&b->views, __ATOMIC_ACQUIRE)) {
+            pthread_rwlock_unlock(&b->latch);
+            _pager_detach(db, b);
+        } else {
+            memcpy(b->buf + file_off % BLOCK_SIZE, buf, len);
+            pthread_rwlock_unlock(&b->latch);
+        }
+        _pager_unpin(db->pager, b);
+    }
+}
 
-        memcpy(&buf[bytes_written], &b->buf[block_start], bytes_to_read);
-        bytes_written += bytes_to_read;
+void pager_mark_clean(struct DB* db, uint32_t idx) {
+    struct Block* b = _pager_pin_cached(db, idx);
+    if (b) {
+        pthread_rwlock_wrlock(&b->latch);
+        b->dirty = false;
+        pthread_rwlock_unlock(&b->latch);
+        _pager_unpin(db->pager, b);
+    }
+}
+
+//used on abort to forget a block holding pending bytes
+//a reader may have it pinned, in which case it is reloaded in place instead, unless it has views
+//NOTE: the pending records should be gone already
+void pager_drop_block(struct DB* db, uint32_t idx) {
+    struct Pager* p = db->pager;
+    pthread_mutex_t* shard = _pager_shard(p, idx);
+    pthread_mutex_lock(&p->list_lock);
+    pthread_mutex_lock(shard);
+    struct Block* b = _pager_find_block(db, idx);
+    if (b && (!__atomic_load_n(&b->pins, __ATOMIC_ACQUIRE) || __atomic_load_n(&b->views, __ATOMIC_ACQUIRE))) {
+        b->dirty = false;
+        _pager_hash_remove(p, b);
+        _pager_list_move(p, b, BLOCK_LIST_FREE, false);
+        b = NULL;
+    } else if (b) {
+        _pager_pin(b);
+    }
+    pthread_mutex_unlock(shard);
+    pthread_mutex_unlock(&p->list_lock);
+
+    if (b) {
+        pthread_rwlock_wrlock(&b->latch);
+        _pager_read_into_blocks(db, &b, 1);
+        pthread_rwlock_unlock(&b->latch);
+        _pager_unpin(p, b);
+    }
+}
+
+//drops every cached block, used when changes were checkpointed by another process before this one saw them
+void pager_invalidate(struct DB* db) {
+    struct Pager* p = db->pager;
+    pthread_mutex_lock(&p->list_lock);
+    for (uint32_t i = 0; i < p->frame_count; i++) {
+        struct Block* b = &p->frames[i];
+        if (!b->valid)
+            continue;
+
+        pthread_mutex_t* shard = _pager_shard(p, b->idx);
+        pthread_mutex_lock(shard);
+        if (!__atomic_load_n(&b->pins, __ATOMIC_ACQUIRE) || __atomic_load_n(&b->views, __ATOMIC_ACQUIRE)) {
+            _pager_hash_remove(p, b);
+            _pager_list_move(p, b, BLOCK_LIST_FREE, false);
+        }
+        pthread_mutex_unlock(shard);
     }
+    pthread_mutex_unlock(&p->list_lock);
 }
 
-void pager_commit_block(struct DB* db, struct Block* block) {
-    struct TimeStamp ts = _pager_new_stamp(block->timestamp);
-    _pager_write_from_block(db, block, ts);
+//the index file only changes size at checkpoints, which start a new log generation
+void pager_refresh_size(struct DB* db) {
+    _pager_set_file_size(db, _file_size(db->idxfd));
 }
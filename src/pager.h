@@ -1,32 +1,172 @@
 #ifndef UDB_PAGER_H
 #define UDB_PAGER_H
 
+#include <stdbool.h>
+#include <pthread.h>
+
 #include "urchin.h"
 #define BLOCK_SIZE 4096
 #define SUPER_OFF 0
 #define SUPER_SIZE BLOCK_SIZE
-#define BLOCKS_MAX BLOCK_SIZE / (sizeof(uint32_t) * 4)
-#define BUCKETS_MAX 1024
-#define FREELIST_OFF SUPER_SIZE
+#define SUPER_MAGIC 0x42445255 //"URDB"
+#define SUPER_VERSION 3
+#define SUPER_VERSION_UNHASHED 2 //records do not store the hash of their key, see table.c
+#define SUPER_VERSION_LEGACY 1 //records may be larger than their size class, see table.c
+#define VERSION_OFF (SUPER_OFF + sizeof(uint32_t))
+#define HEAP_END_OFF (SUPER_OFF + sizeof(uint32_t) * 2) //after magic and version
+#define HEAP_EXTENT (256 * 1024)
+#define BLOCKS_MIN 8
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define GHOST_NONE UINT32_MAX
+#define MAP_EXTENT (64 * 1024 * 1024)
+#define PAGER_IOV_MAX 32
+#define PAGER_VIEW_SHARE 4 //views pin at most this fraction of the pool
+#define PAGER_CHECKPOINT_BLOCKS (PAGER_IOV_MAX * 8) //blocks a checkpoint writes per batch
+#define PAGER_SHARDS 64
+#define PAGER_NO_SNAPSHOT UINT32_MAX
+#define HASH_STATE_OFF (HEAP_END_OFF + sizeof(uint32_t)) //linear hashing state, see table.c
+#define HASH_SEGMENTS_MAX 16
+#define HASH_STATE_SIZE (sizeof(uint32_t) * (3 + HASH_SEGMENTS_MAX))
+#define ENGINE_OFF (HASH_STATE_OFF + HASH_STATE_SIZE)
+#define TREE_ROOT_OFF (ENGINE_OFF + sizeof(uint32_t))
+#define FREE_CLASSES 48
+#define FREE_CLASS_MIN 16
+#define FREE_CLASS_OFF (TREE_ROOT_OFF + sizeof(uint32_t)) //free list heads, one per size class
+#define FREE_LARGE_OFF (FREE_CLASS_OFF + sizeof(uint32_t) * FREE_CLASSES)
+#define EXTENT_OFF (FREE_LARGE_OFF + sizeof(uint32_t)) //unused tail of the last heap extent
+#define EXTENT_END_OFF (EXTENT_OFF + sizeof(uint32_t))
+#define COMPACT_OFF (EXTENT_END_OFF + sizeof(uint32_t)) //online compaction state, see table.c
+#define COMPACT_STEP 8 //records moved by each write while a compaction runs
+#define COMPACT_STATE_SIZE (sizeof(uint32_t) * 6)
+#define FILTER_OFF (COMPACT_OFF + COMPACT_STATE_SIZE) //per-bucket Bloom filters, see table.c
+#define FILTER_STATE_SIZE (sizeof(uint32_t) * (1 + HASH_SEGMENTS_MAX))
+#define DIR_OFF (FILTER_OFF + FILTER_STATE_SIZE) //bucket directory, chain heads kept with their filters, see table.c
+#define DIR_STATE_SIZE (sizeof(uint32_t) * (1 + HASH_SEGMENTS_MAX))
+#define DIR_ENTRY_SIZE 16
+#define DIR_INIT_SIZE (BUCKETS_INIT * DIR_ENTRY_SIZE) //entries of the first BUCKETS_INIT buckets
+#define VALUE_EXTENT_OFF (DIR_OFF + DIR_STATE_SIZE) //unused tail of the last extent of value records, see table.c
+#define HASH_LOAD_MAX 2 //records per bucket before a split
+#define HASH_SPLIT_BATCH 16
+#define BUCKETS_INIT 1024
+#define FREELIST_OFF SUPER_SIZE //free records of legacy files, moved into the size classes as they are used
 #define HASHTAB_OFF sizeof(uint32_t) + SUPER_SIZE //first 4 bytes is freelist
-#define RECORD_OFF HASHTAB_OFF + sizeof(uint32_t) * BUCKETS_MAX
-#define KEY_OFF sizeof(uint32_t) * 3
+#define RECORD_OFF HASHTAB_OFF + sizeof(uint32_t) * BUCKETS_INIT
+#define DIR_INIT_OFF ((RECORD_OFF + DIR_ENTRY_SIZE - 1) / DIR_ENTRY_SIZE * DIR_ENTRY_SIZE) //directory segment 0 of a new file
+#define REC_HEADER_SIZE (sizeof(uint32_t) * 4)
+#define REC_HEADER_SIZE_UNHASHED (sizeof(uint32_t) * 3) //also the header of every free record
+#define REC_VALUE_OUT 0x80000000u //set in a stored data_len if the data is in a value record, see table.c
+
+enum BlockListType {
+    BLOCK_LIST_FREE,
+    BLOCK_LIST_HOT, //LRU list, or Am for 2Q
+    BLOCK_LIST_IN   //A1in FIFO for 2Q
+};
 
-struct TimeStamp {
-    uint32_t seconds;
-    uint32_t counter;
+//iterator touches use PAGER_HINT_SCAN so that one pass over the file does not flush the hot set
+enum PagerHint {
+    PAGER_HINT_NORMAL,
+    PAGER_HINT_SCAN
 };
 
+//frames are linked into an intrusive doubly linked replacement list (head is most-recently used)
+//and into a hash chain keyed by block index so lookups, misses and evictions are O(1)
+//a pinned frame is never evicted; its latch is held exclusively while the block is loaded into it,
+//so threads that find it in the table wait on the latch until its contents are there
+//a frame with views (see pager_view) is never changed: it is taken out of the table instead and the block
+//is loaded again, so the views keep the bytes they were given
 struct Block {
+    struct Block* prev;
     struct Block* next;
-    char buf[BLOCK_SIZE];
+    struct Block* hnext;
+    char* buf;
     uint32_t idx;
-    struct TimeStamp timestamp;
-    bool dirty;
+    uint32_t pins; //changed atomically, and only raised with the frame's table shard locked
+    uint32_t views; //changed atomically, and only raised with the frame latched for reading
+    pthread_rwlock_t latch;
+    enum BlockListType list;
+    bool dirty; //holds changes not committed to the log yet
+    bool valid;
+    bool scan; //loaded by a scan and not referenced since
+};
+
+//part of the file a batched lookup is about to read, see pager_load
+struct PagerRange {
+    uint64_t off;
+    uint32_t len;
+    uint32_t tag; //the caller's, to tell what the range was for once they are sorted
+};
+
+struct BlockList {
+    struct Block* head;
+    struct Block* tail;
+    uint32_t count;
+};
+
+//frame buffers live in one page-aligned (optionally huge page backed) arena
+//frames hold the index file contents with logged changes replayed on top, so they never need writing back
+//in mmap mode, blocks without logged changes are read straight from a read-only mapping of the file,
+//which is remapped in MAP_EXTENT steps as checkpoints grow the file
+//with DB_CACHE_2Q, new blocks enter the A1in FIFO and only blocks referenced again after
+//falling out of it (remembered in the A1out ghost ring) are promoted to the hot list
+//threads reading through one handle share the pool: hash chains are guarded by PAGER_SHARDS mutexes
+//(by chain slot), the replacement lists and ghosts by 'list_lock', which a hit only takes if it is free -
+//a touch can be skipped, a lookup cannot; everything else changes only with the handle to itself
+struct Pager {
+    struct Block* frames;
+    uint32_t frame_count;
+    uint64_t file_size;
+    char* arena;
+    size_t arena_size;
+    bool huge_pages;
+    struct Block** table;
+    uint32_t table_mask;
+    enum DbCachePolicy policy;
+    pthread_mutex_t shards[PAGER_SHARDS];
+    pthread_mutex_t list_lock;
+    pthread_cond_t frame_freed; //signalled on list_lock when a frame is unpinned while 'frame_waiters' wait for one
+    uint32_t frame_waiters;
+    uint32_t pinners; //calls pinning a chunk of blocks at once, see _pager_chunk
+    uint32_t view_pins; //frames pinned by views, see pager_view
+    struct BlockList free;
+    struct BlockList hot;
+    struct BlockList in;
+    uint32_t in_max;
+    uint32_t* ghost_ids;
+    uint32_t* ghost_next;
+    uint32_t* ghost_table;
+    uint32_t ghost_max;
+    uint32_t ghost_pos;
+    bool map_mode;
+    char* map;
+    size_t map_size;
+    bool async_io; //batches of reads and writes go through io_uring, see io.c
+    uint32_t checkpoint_size; //log size at which a commit checkpoints, raised while a checkpointer runs
+    uint64_t checkpoint_written; //bytes checkpoints have written to the index file
 };
 
-void pager_write(struct DB* db, uint32_t file_off, char* buf, uint32_t len);
-void pager_read(struct DB* db, uint32_t file_off, char* buf, uint32_t len);
-void pager_commit_block(struct DB* db, struct Block* block);
+void pager_open(struct DB* db, uint64_t cache_bytes, bool huge_pages, enum DbCachePolicy policy, bool map_mode, bool async_io);
+void pager_close(struct DB* db);
+void pager_resize(struct DB* db, uint64_t cache_bytes);
+enum PagerHint pager_hint(struct DB* db, enum PagerHint hint);
+void pager_write(struct DB* db, uint64_t file_off, char* buf, uint32_t len);
+void pager_read(struct DB* db, uint64_t file_off, char* buf, uint32_t len);
+const char* pager_view(struct DB* db, uint64_t file_off, uint32_t len, struct Block** frame);
+void pager_view_release(struct DB* db, struct Block* frame);
+void pager_prefetch(struct DB* db, uint64_t file_off, uint32_t len);
+void pager_sort_ranges(struct PagerRange* ranges, uint32_t count);
+uint32_t pager_load(struct DB* db, const struct PagerRange* ranges, uint32_t count);
+void pager_begin(struct DB* db);
+void pager_commit(struct DB* db);
+void pager_abort(struct DB* db);
+bool pager_checkpoint(struct DB* db);
+bool pager_snapshot_begin(struct DB* db);
+void pager_snapshot_end(struct DB* db);
+bool pager_heap_room(struct DB* db, uint64_t len);
+uint32_t pager_grow(struct DB* db, uint32_t len);
+void pager_patch(struct DB* db, uint64_t file_off, const char* buf, uint32_t len);
+void pager_mark_clean(struct DB* db, uint32_t idx);
+void pager_drop_block(struct DB* db, uint32_t idx);
+void pager_invalidate(struct DB* db);
+void pager_refresh_size(struct DB* db);
 
 #endif //UDB_PAGER_H
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+#include "pager.h"
+#include "lock.h"
+#include "util.h"
+
+//processes opening the same index file with a shared pool map one POSIX shared memory segment, named after
+//the file's device and inode, and keep committed block images in it for each other (see pager.c)
+//images are never written back - an image is only used by a handle whose log holds no record for the block
+//newer than the image, and none older than the last checkpoint, so stale images simply go unused
+//a process that dies holding a set lock leaves the lock to the next process to take it, which drops the
+//set's images in case one was half copied
+//each handle holds a read lock on LOCK_POOL_OFF while it has the segment mapped, and the last one to close
+//removes the segment (one left by processes that all died goes with the next handle to close)
+
+inline static struct SharedSet* _shared_set(struct SharedPool* s, uint32_t idx) {
+    return &s->sets[(idx * 2654435761u) % s->set_count];
+}
+
+inline static char* _shared_slot_data(struct SharedPool* s, struct SharedSet* set, uint32_t way) {
+    return s->data + ((size_t)(set - s->sets) * SHARED_WAYS + way) * BLOCK_SIZE;
+}
+
+static void _shared_lock(struct SharedSet* set) {
+    int res = pthread_mutex_lock(&set->lock);
+    if (res == EOWNERDEAD) {
+        for (uint32_t w = 0; w < SHARED_WAYS; w++) {
+            set->slots[w].valid = false;
+        }
+        pthread_mutex_consistent(&set->lock);
+    } else if (res) {
+        errno = res;
+        err_quit("pthread_mutex_lock failed");
+    }
+}
+
+static void _shared_init(struct SharedPool* s) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (uint32_t i = 0; i < s->set_count; i++) {
+        memset(&s->sets[i], 0, sizeof(struct SharedSet));
+        pthread_mutex_init(&s->sets[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+//'bytes' sizes the segment when this process creates it; later processes use it as it is
+//'reset' starts a new segment, for an index file or log that was just created - images of whatever file
+//had the name before would otherwise look current
+//NOTE: index file should be write-locked, so one process sets the segment up while the others wait
+void shared_open(struct DB* db, uint64_t bytes, bool reset) {
+    struct stat st;
+    if (fstat(db->idxfd, &st) < 0)
+        err_quit("fstat failed");
+    struct SharedPool* s = _calloc(1, sizeof(struct SharedPool));
+    snprintf(s->name, sizeof(s->name), "/urchin-%lx-%lx", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+
+    if (reset && shm_unlink(s->name) < 0 && errno != ENOENT)
+        err_quit("shm_unlink failed");
+    int fd = shm_open(s->name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        err_quit("shm_open failed");
+
+    //the magic is written last, so a segment whose creator died part way through is set up again
+    struct SharedHeader h = {0};
+    if (_file_size(fd) >= sizeof(struct SharedHeader))
+        _pread(fd, &h, sizeof(struct SharedHeader), 0);
+    bool init = h.magic != SHARED_MAGIC;
+    if (init) {
+        h.set_count = bytes / (SHARED_WAYS * BLOCK_SIZE) ? bytes / (SHARED_WAYS * BLOCK_SIZE) : 1;
+        h.data_off = (sizeof(struct SharedHeader) + h.set_count * sizeof(struct SharedSet) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        _ftruncate(fd, 0);
+        _ftruncate(fd, h.data_off + (uint64_t)h.set_count * SHARED_WAYS * BLOCK_SIZE);
+    }
+
+    s->size = h.data_off + (uint64_t)h.set_count * SHARED_WAYS * BLOCK_SIZE;
+    s->base = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->base == MAP_FAILED)
+        err_quit("mmap failed");
+    close(fd);
+    s->sets = (struct SharedSet*)(s->base + sizeof(struct SharedHeader));
+    s->set_count = h.set_count;
+    s->data = s->base + h.data_off;
+
+    if (init) {
+        _shared_init(s);
+        h.magic = SHARED_MAGIC;
+        memcpy(s->base, &h, sizeof(struct SharedHeader));
+    }
+
+    _ofd_lock(db->idxfd, F_RDLCK, LOCK_POOL_OFF, 1, true);
+    db->shared = s;
+}
+
+//the segment is removed by the last handle to let go of it, under the same lock it is set up under,
+//so a process opening the file meanwhile either finds it still there or creates a new one
+//NOTE: the index file should still be open
+void shared_close(struct DB* db) {
+    if (!db->shared)
+        return;
+
+    _write_lock(db->idxfd, SEEK_SET, 0, LOCK_SNAPSHOT_OFF);
+    _ofd_lock(db->idxfd, F_UNLCK, LOCK_POOL_OFF, 1, true);
+    if (_ofd_lock(db->idxfd, F_WRLCK, LOCK_POOL_OFF, 1, false)) {
+        if (shm_unlink(db->shared->name) < 0 && errno != ENOENT)
+            err_quit("shm_unlink failed");
+        _ofd_lock(db->idxfd, F_UNLCK, LOCK_POOL_OFF, 1, true);
+    }
+    _unlock(db->idxfd, SEEK_SET, 0, LOCK_SNAPSHOT_OFF);
+
+    munmap(db->shared->base, db->shared->size);
+    free(db->shared);
+    db->shared = NULL;
+}
+
+//copies the image of a block into 'buf' if the pool has one with an lsn in [min_lsn, max_lsn]
+bool shared_get(struct DB* db, uint32_t idx, char* buf, uint64_t min_lsn, uint64_t max_lsn) {
+    struct SharedPool* s = db->shared;
+    struct SharedSet* set = _shared_set(s, idx);
+
+    bool found = false;
+    _shared_lock(set);
+    for (uint32_t w = 0; w < SHARED_WAYS; w++) {
+        struct SharedSlot* slot = &set->slots[w];
+        if (slot->valid && slot->idx == idx && slot->lsn >= min_lsn && slot->lsn <= max_lsn) {
+            memcpy(buf, _shared_slot_data(s, set, w), BLOCK_SIZE);
+            slot->used = ++set->clock;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return found;
+}
+
+//offers an image of a block to the other processes, replacing an older image of the same block
+//or else the least recently used way of its set
+void shared_put(struct DB* db, uint32_t idx, const char* buf, uint64_t lsn) {
+    struct SharedPool* s = db->shared;
+    struct SharedSet* set = _shared_set(s, idx);
+
+    _shared_lock(set);
+    struct SharedSlot* victim = NULL;
+    uint32_t way = 0;
+    for (uint32_t w = 0; w < SHARED_WAYS; w++) {
+        struct SharedSlot* slot = &set->slots[w];
+        if (slot->valid && slot->idx == idx) {
+            victim = slot->lsn < lsn ? slot : NULL;
+            way = w;
+            if (!victim) {
+                pthread_mutex_unlock(&set->lock);
+                return;
+            }
+            break;
+        }
+        if (!victim || (victim->valid && (!slot->valid || slot->used < victim->used))) {
+            victim = slot;
+            way = w;
+        }
+    }
+
+    victim->valid = false;
+    memcpy(_shared_slot_data(s, set, way), buf, BLOCK_SIZE);
+    victim->idx = idx;
+    victim->lsn = lsn;
+    victim->used = ++set->clock;
+    victim->valid = true;
+    pthread_mutex_unlock(&set->lock);
+}
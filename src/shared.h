@@ -0,0 +1,49 @@
+#ifndef UDB_SHARED_H
+#define UDB_SHARED_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "urchin.h"
+
+#define SHARED_MAGIC 0x4c4f4f50 //"POOL"
+#define SHARED_WAYS 4
+
+//an image of one block: the index file contents with every committed log record up to 'lsn' replayed on top
+//the log is shared, so the image is the same whichever process built it
+struct SharedSlot {
+    uint32_t idx;
+    bool valid;
+    uint64_t lsn;
+    uint64_t used; //set clock at the last hit, the least recently used way is replaced
+};
+
+//slots are grouped in sets of SHARED_WAYS by block index, each set guarded by one robust process-shared mutex
+struct SharedSet {
+    pthread_mutex_t lock;
+    uint64_t clock;
+    struct SharedSlot slots[SHARED_WAYS];
+};
+
+//the segment is a header, the sets, then the block images, one per slot
+struct SharedHeader {
+    uint32_t magic;
+    uint32_t set_count;
+    uint64_t data_off;
+};
+
+struct SharedPool {
+    char name[64];
+    char* base;
+    size_t size;
+    struct SharedSet* sets;
+    char* data;
+    uint32_t set_count;
+};
+
+void shared_open(struct DB* db, uint64_t bytes, bool reset);
+void shared_close(struct DB* db);
+bool shared_get(struct DB* db, uint32_t idx, char* buf, uint64_t min_lsn, uint64_t max_lsn);
+void shared_put(struct DB* db, uint32_t idx, const char* buf, uint64_t lsn);
+
+#endif //UDB_SHARED_H
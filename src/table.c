@@ -1,107 +1,774 @@
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "table.h"
 #include "util.h"
 #include "pager.h"
+#include "lock.h"
 
 
+//linear hashing: the table starts with BUCKETS_INIT buckets and splits one bucket at a time, in order,
+//whenever the average chain grows past HASH_LOAD_MAX records, so no insert ever rehashes more than one chain
+//a key hashes to bucket h % (BUCKETS_INIT << level), or h % (BUCKETS_INIT << (level + 1)) if that bucket
+//was already split this round (is below 'split')
+//the first BUCKETS_INIT chain heads are at HASHTAB_OFF, the rest are in segments allocated from the heap
+//as the table grows, segment k (k >= 1) holding the heads of buckets [BUCKETS_INIT << (k - 1), BUCKETS_INIT << k)
+struct HashState {
+    uint32_t level;
+    uint32_t split;
+    uint32_t rec_count;
+    uint32_t seg_off[HASH_SEGMENTS_MAX];
+};
+
+//online compaction runs in three phases of bounded steps, each walking every bucket in order:
+//MOVE_UP copies every record (and hash segment) below 'low_end', the heap end when the compaction started,
+//to new space past it; MOVE_DOWN then copies them back to the front of the heap, one bucket after another,
+//so that each chain ends up contiguous; MOVE_VALUES does the same for the value records, which MOVE_DOWN
+//leaves where they are, so that the chains end up packed together in front of all the values;
+//the heap is finally cut back to where the copies end
+//which records to move is decided by address alone, so inserts, deletes and splits can run between steps
+//while a compaction runs, new space comes from the same place as the copies and freed space is not reused
+//a file from before record hashes were stored is upgraded by a compaction started on its first write,
+//with 'rehash' set: MOVE_UP gives every record it copies a hash, so the file is fully converted by MOVE_DOWN
+enum CompactPhase {
+    COMPACT_NONE,
+    COMPACT_MOVE_UP,
+    COMPACT_MOVE_DOWN,
+    COMPACT_MOVE_VALUES
+};
+
+struct CompactState {
+    uint32_t phase;
+    uint32_t bucket; //next bucket to walk
+    uint32_t low_end;
+    uint32_t frontier; //end of the copies made by MOVE_DOWN
+    uint32_t overflow; //something had to stay past low_end, so the heap cannot be cut back
+    uint32_t rehash;
+};
+
+//every bucket has a 64-bit Bloom filter of the key hashes in its chain, so most lookups of absent keys stop
+//at the filter without reading the chain; filters are kept in segments laid out like the chain heads,
+//segment 0 (the first BUCKETS_INIT buckets) included, which is allocated with the file
+//a filter only ever holds the chain's current keys: inserts add to it, deletes and splits recompute it
+//files from before the filters get them from their next compaction, and lookups ignore them until it is done
+struct FilterState {
+    uint32_t valid;
+    uint32_t seg_off[HASH_SEGMENTS_MAX];
+};
+
+//the bucket directory keeps each chain head together with its filter, so a lookup reads one block to learn both
+//whether the chain can hold the key and where it starts; it is kept in segments laid out like the filters,
+//in entries of DIR_ENTRY_SIZE bytes; segments start at a multiple of it, which divides BLOCK_SIZE, so that no
+//entry straddles two blocks (segments of older files are aligned by their next compaction)
+//files from before the directory have it built by their next compaction: MOVE_DOWN fills in the entry of each
+//bucket as it is done with it, and the bucket is looked up there from then on; the old heads and filters are
+//freed at the end, but for the first BUCKETS_INIT heads, which have a place of their own
+struct DirState {
+    uint32_t valid;
+    uint32_t seg_off[HASH_SEGMENTS_MAX];
+};
+
+struct DirEntry {
+    uint64_t filter;
+    uint32_t head;
+    uint32_t unused;
+};
+
+static uint32_t _table_alloc(struct DB* db, uint32_t size);
+static uint64_t _table_grow_max(uint64_t size);
+
 //FNV-1a hash function
-static uint32_t _hash_key(const char* key) {
-    int len = strlen(key);
+static uint32_t _hash_key(const char* key, uint32_t len) {
     uint32_t hash = 2166136261u;
-    for (int i = 0; i < len; i++) {
+    for (uint32_t i = 0; i < len; i++) {
         hash ^= (uint8_t)key[i];
         hash *= 16777619;
     } 
     return hash;
 }
 
-struct Record table_read_rec(struct DB* db, uint32_t rec_off) {
+static void _table_read_compact(struct DB* db, struct CompactState* cs) {
+    pager_read(db, COMPACT_OFF, cs, sizeof(struct CompactState));
+}
+
+static uint32_t _table_version(struct DB* db) {
+    uint32_t version;
+    pager_read(db, VERSION_OFF, &version, sizeof(uint32_t));
+    return version;
+}
+
+//records at or past the returned offset have a hash in their header, the others (in older files) do not
+//new space always comes from past it, see _table_alloc
+static uint32_t _table_hashed_from(struct DB* db) {
+    if (_table_version(db) >= SUPER_VERSION)
+        return 0;
+
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    if (cs.phase == COMPACT_NONE || !cs.rehash)
+        return UINT32_MAX;
+    return cs.phase == COMPACT_MOVE_UP ? cs.low_end : 0;
+}
+
+static uint32_t _table_header_len(uint32_t rec_off, uint32_t hashed_from) {
+    return rec_off >= hashed_from ? REC_HEADER_SIZE : REC_HEADER_SIZE_UNHASHED;
+}
+
+static void _table_read_state(struct DB* db, struct HashState* hs) {
+    pager_read(db, HASH_STATE_OFF, hs, sizeof(struct HashState));
+}
+
+static uint32_t _table_segment(uint32_t bucket) {
+    uint32_t seg = 0;
+    while (bucket >= ((uint32_t)BUCKETS_INIT << seg)) {
+        seg++;
+    }
+    return seg;
+}
+
+static void _table_read_dir(struct DB* db, struct DirState* ds) {
+    pager_read(db, DIR_OFF, ds, sizeof(struct DirState));
+}
+
+//file offset of the directory entry of 'bucket'
+static uint32_t _table_dir_off(struct DirState* ds, uint32_t bucket) {
+    uint32_t seg = _table_segment(bucket);
+    uint32_t seg_start = seg ? BUCKETS_INIT << (seg - 1) : 0;
+    return ds->seg_off[seg] + (bucket - seg_start) * DIR_ENTRY_SIZE;
+}
+
+//allocates a directory segment, aligned as struct DirState says - the bytes skipped to get there go unused
+static uint32_t _table_alloc_dir(struct DB* db, uint32_t buckets) {
+    uint32_t off = _table_alloc(db, buckets * DIR_ENTRY_SIZE + DIR_ENTRY_SIZE - 1);
+    return (off + DIR_ENTRY_SIZE - 1) / DIR_ENTRY_SIZE * DIR_ENTRY_SIZE;
+}
+
+//true if 'bucket' is looked up in the directory, see struct DirState
+static bool _table_in_dir(struct DB* db, struct DirState* ds, uint32_t bucket) {
+    if (ds->valid || !ds->seg_off[0])
+        return ds->valid;
+
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    return (cs.phase == COMPACT_MOVE_DOWN && bucket < cs.bucket) || cs.phase == COMPACT_MOVE_VALUES;
+}
+
+//file offset of the chain head of 'bucket'
+static uint32_t _table_head_off(struct DB* db, struct HashState* hs, uint32_t bucket) {
+    struct DirState ds;
+    _table_read_dir(db, &ds);
+    if (_table_in_dir(db, &ds, bucket))
+        return _table_dir_off(&ds, bucket) + offsetof(struct DirEntry, head);
+
+    if (bucket < BUCKETS_INIT)
+        return HASHTAB_OFF + bucket * sizeof(uint32_t);
+
+    uint32_t seg = _table_segment(bucket);
+    uint32_t seg_start = BUCKETS_INIT << (seg - 1);
+    return hs->seg_off[seg] + (bucket - seg_start) * sizeof(uint32_t);
+}
+
+static uint32_t _table_bucket(struct HashState* hs, uint32_t hash) {
+    uint32_t bucket = hash % (BUCKETS_INIT << hs->level);
+    if (bucket < hs->split)
+        bucket = hash % (BUCKETS_INIT << (hs->level + 1));
+    return bucket;
+}
+
+
+static struct Record _table_read_rec(struct DB* db, uint32_t rec_off, uint32_t hashed_from) {
     struct Record r;
-    int len = sizeof(uint32_t) * 3;
-    char buf[len];
+    uint32_t len = _table_header_len(rec_off, hashed_from);
+    char buf[REC_HEADER_SIZE];
     pager_read(db, rec_off, buf, len);
 
     r.next_off = *((uint32_t*)(buf));
     r.key_len  = *((uint32_t*)(buf + sizeof(uint32_t)));
     r.data_len = *((uint32_t*)(buf + sizeof(uint32_t) * 2));
+    r.hash = len == REC_HEADER_SIZE ? *((uint32_t*)(buf + sizeof(uint32_t) * 3)) : 0;
+    r.header_len = len;
+    r.value_off = 0;
+    if (r.data_len & REC_VALUE_OUT) {
+        r.data_len &= ~REC_VALUE_OUT;
+        pager_read(db, rec_off + len + r.key_len, &r.value_off, sizeof(uint32_t));
+    }
 
     return r;
 }
 
-static uint32_t _table_get_free_rec(struct DB* db, uint32_t len) {
+//bytes of the record after its header
+static uint32_t _table_body_len(struct Record* r) {
+    return r->key_len + (r->value_off ? sizeof(uint32_t) : r->data_len);
+}
+
+//hash of the record's key, read from the header if it has one
+static uint32_t _table_rec_hash(struct DB* db, uint32_t rec_off, struct Record* r) {
+    if (r->header_len == REC_HEADER_SIZE)
+        return r->hash;
+
+    char rec_key[r->key_len + 1];
+    pager_read(db, rec_off + r->header_len, rec_key, r->key_len);
+    return _hash_key(rec_key, r->key_len);
+}
+
+//true if the record holds 'key' - the key is only read when the length and the stored hash match
+static bool _table_rec_matches(struct DB* db, uint32_t rec_off, struct Record* r, const char* key, uint32_t key_len, uint32_t hash) {
+    if (r->key_len != key_len || (r->header_len == REC_HEADER_SIZE && r->hash != hash))
+        return false;
+
+    char rec_key[r->key_len + 1];
+    pager_read(db, rec_off + r->header_len, rec_key, r->key_len);
+    return memcmp(rec_key, key, key_len) == 0;
+}
+
+static void _table_read_filter(struct DB* db, struct FilterState* fs) {
+    pager_read(db, FILTER_OFF, fs, sizeof(struct FilterState));
+}
+
+static uint32_t _table_filter_off(struct FilterState* fs, uint32_t bucket) {
+    uint32_t seg = _table_segment(bucket);
+    uint32_t seg_start = seg ? BUCKETS_INIT << (seg - 1) : 0;
+    return fs->seg_off[seg] + (bucket - seg_start) * sizeof(uint64_t);
+}
+
+//three bits picked by the high bits of the hash - the low ones choose the bucket
+static uint64_t _table_filter_bits(uint32_t hash) {
+    uint32_t mix = hash * 0x9e3779b1u;
+    return 1ull << (mix >> 26) | 1ull << (mix >> 20 & 63) | 1ull << (mix >> 14 & 63);
+}
+
+//false if 'bucket' certainly holds no key with this hash
+static bool _table_filter_may_hold(struct DB* db, uint32_t bucket, uint32_t hash) {
+    struct DirState ds;
+    _table_read_dir(db, &ds);
+    uint32_t filter_off;
+    if (_table_in_dir(db, &ds, bucket)) {
+        filter_off = _table_dir_off(&ds, bucket) + offsetof(struct DirEntry, filter);
+    } else {
+        struct FilterState fs;
+        _table_read_filter(db, &fs);
+        if (!fs.valid)
+            return true;
+        filter_off = _table_filter_off(&fs, bucket);
+    }
+
+    uint64_t filter;
+    uint64_t bits = _table_filter_bits(hash);
+    pager_read(db, filter_off, &filter, sizeof(uint64_t));
+    return (filter & bits) == bits;
+}
+
+//sets the filter of 'bucket' (if it has one) to 'filter', or adds 'filter' to it
+static void _table_filter_write(struct DB* db, uint32_t bucket, uint64_t filter, bool add) {
+    struct DirState ds;
+    _table_read_dir(db, &ds);
+    uint32_t filter_off;
+    if (_table_in_dir(db, &ds, bucket)) {
+        filter_off = _table_dir_off(&ds, bucket) + offsetof(struct DirEntry, filter);
+    } else {
+        struct FilterState fs;
+        _table_read_filter(db, &fs);
+        if (!fs.seg_off[_table_segment(bucket)])
+            return;
+        filter_off = _table_filter_off(&fs, bucket);
+    }
+
+    uint64_t old;
+    pager_read(db, filter_off, &old, sizeof(uint64_t));
+    if (add)
+        filter |= old;
+    if (filter != old)
+        pager_write(db, filter_off, &filter, sizeof(uint64_t));
+}
+
+//recomputes the filter of a chain from the hashes of its records
+static void _table_filter_rebuild(struct DB* db, struct HashState* hs, uint32_t bucket) {
     uint32_t cur;
-    pager_read(db, FREELIST_OFF, (char*)&cur, sizeof(uint32_t));
-    uint32_t prev = FREELIST_OFF;
+    pager_read(db, _table_head_off(db, hs, bucket), &cur, sizeof(uint32_t));
+    uint32_t hashed_from = _table_hashed_from(db);
 
-    //search freelist for empty record with large enough size to hold key and data
+    uint64_t filter = 0;
     while (cur) {
-        struct Record r = table_read_rec(db, cur);
+        struct Record r = _table_read_rec(db, cur, hashed_from);
+        filter |= _table_filter_bits(_table_rec_hash(db, cur, &r));
+        cur = r.next_off;
+    }
+    _table_filter_write(db, bucket, filter, false);
+}
+
+//reads where the chain of 'bucket' starts into 'head', returning false instead if its filter rules out 'hash'
+//a bucket in the directory gets both from its entry in one read
+static bool _table_chain_start(struct DB* db, struct HashState* hs, uint32_t bucket, uint32_t hash, uint32_t* head) {
+    struct DirState ds;
+    _table_read_dir(db, &ds);
+    if (_table_in_dir(db, &ds, bucket)) {
+        struct DirEntry e;
+        uint64_t bits = _table_filter_bits(hash);
+        pager_read(db, _table_dir_off(&ds, bucket), &e, sizeof(struct DirEntry));
+        *head = e.head;
+        return (e.filter & bits) == bits;
+    }
+
+    if (!_table_filter_may_hold(db, bucket, hash))
+        return false;
+    pager_read(db, _table_head_off(db, hs, bucket), head, sizeof(uint32_t));
+    return true;
+}
+
+uint32_t table_key_bucket(struct DB* db, const char* key, uint32_t key_len) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    return _table_bucket(&hs, _hash_key(key, key_len));
+}
+
+uint32_t table_bucket_count(struct DB* db) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    return (BUCKETS_INIT << hs.level) + hs.split;
+}
+
+uint32_t table_bucket_head(struct DB* db, uint32_t bucket) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t head;
+    pager_read(db, _table_head_off(db, &hs, bucket), &head, sizeof(uint32_t));
+    return head;
+}
+
+//splits the next bucket in order, moving the records whose hash now maps to its new image bucket
+//the chain is relinked in place, so the cost is one pass over a single (short) chain
+static bool _table_split_due(struct HashState* hs) {
+    uint32_t round = BUCKETS_INIT << hs->level;
+    return hs->rec_count > (round + hs->split) * HASH_LOAD_MAX && _table_segment(hs->split + round) < HASH_SEGMENTS_MAX;
+}
+
+//returns false if the heap has no room for the new segment, leaving the bucket as it is
+static bool _table_split(struct DB* db, struct HashState* hs) {
+    uint32_t round = BUCKETS_INIT << hs->level;
+    uint32_t old_bucket = hs->split;
+    uint32_t new_bucket = old_bucket + round;
 
-        if (r.data_len + r.key_len >= len) {
-            //remove from freelist
-            pager_write(db, prev, (char*)&r.next_off, sizeof(uint32_t));
-            return cur; 
+    uint32_t seg = _table_segment(new_bucket);
+    if (seg >= HASH_SEGMENTS_MAX)
+        return false;
+    if (new_bucket == ((uint32_t)BUCKETS_INIT << (seg - 1))) {
+        //first bucket of a new segment - heads (and filters) are all written as buckets are split into it
+        //the old heads and filters are only kept until the directory is built
+        uint32_t buckets = BUCKETS_INIT << (seg - 1);
+        struct DirState ds;
+        struct FilterState fs;
+        _table_read_dir(db, &ds);
+        _table_read_filter(db, &fs);
+        uint64_t grow = ds.seg_off[0] ? _table_grow_max((uint64_t)(buckets + 1) * DIR_ENTRY_SIZE) : 0;
+        if (!ds.valid)
+            grow += _table_grow_max(buckets * sizeof(uint32_t)) + (fs.seg_off[0] ? _table_grow_max(buckets * sizeof(uint64_t)) : 0);
+        if (!table_has_room(db, grow))
+            return false;
+
+        if (!ds.valid) {
+            hs->seg_off[seg] = _table_alloc(db, buckets * sizeof(uint32_t));
+            if (fs.seg_off[0]) {
+                uint32_t filter_seg = _table_alloc(db, buckets * sizeof(uint64_t));
+                pager_write(db, FILTER_OFF + offsetof(struct FilterState, seg_off) + seg * sizeof(uint32_t), &filter_seg, sizeof(uint32_t));
+            }
+        }
+        if (ds.seg_off[0]) {
+            uint32_t dir_seg = _table_alloc_dir(db, buckets);
+            pager_write(db, DIR_OFF + offsetof(struct DirState, seg_off) + seg * sizeof(uint32_t), &dir_seg, sizeof(uint32_t));
         }
+    }
+
+    uint32_t old_tail = _table_head_off(db, hs, old_bucket);
+    uint32_t new_tail = _table_head_off(db, hs, new_bucket);
+    uint32_t cur;
+    pager_read(db, old_tail, &cur, sizeof(uint32_t));
+    uint32_t hashed_from = _table_hashed_from(db);
+    uint64_t old_filter = 0;
+    uint64_t new_filter = 0;
+
+    while (cur) {
+        struct Record r = _table_read_rec(db, cur, hashed_from);
+        uint32_t hash = _table_rec_hash(db, cur, &r);
+
+        bool stays = hash % (round << 1) == old_bucket;
+        uint32_t* tail = stays ? &old_tail : &new_tail;
+        pager_write(db, *tail, &cur, sizeof(uint32_t));
+        *tail = cur; //next_off is the first field of a record
+        *(stays ? &old_filter : &new_filter) |= _table_filter_bits(hash);
 
-        prev = cur;
         cur = r.next_off;
     }
+    _table_filter_write(db, old_bucket, old_filter, false);
+    _table_filter_write(db, new_bucket, new_filter, false);
+
+    uint32_t zero = 0;
+    pager_write(db, old_tail, &zero, sizeof(uint32_t));
+    pager_write(db, new_tail, &zero, sizeof(uint32_t));
+
+    if (++hs->split == round) {
+        hs->level++;
+        hs->split = 0;
+    }
+    return true;
+}
+
+struct Record table_read_rec(struct DB* db, uint32_t rec_off) {
+    return _table_read_rec(db, rec_off, _table_hashed_from(db));
+}
 
-    //no free record found - will append to end of file
-    _fseek(db->idxf, 0, SEEK_END);
-    uint64_t offset = _ftell(db->idxf);
-    char buf[sizeof(uint32_t) * 3 + len]; //fill with junk so that file is proper size (probably not ideal)
-    _fwrite(buf, sizeof(char), sizeof(uint32_t) * 3 + len, db->idxf);
-    return offset;
+//free space is kept in segregated lists, one per size class, with heads in the super block
+//classes are spaced four to a doubling from FREE_CLASS_MIN, so rounding a record up to its class wastes at most
+//a fifth of it; records above the largest class are kept exact-sized on a first-fit list
+//a record's capacity is the class of its current size: an update only stays in place if the size class is unchanged,
+//so freeing a record puts it back on the list it was allocated from
+//new space is carved from the tail of the last heap extent, and the heap grows by HEAP_EXTENT at a time
+static uint32_t _table_class_size(uint32_t c) {
+    uint32_t base = FREE_CLASS_MIN << (c / 4);
+    return base + base / 4 * (c % 4);
 }
 
+//smallest class that holds 'size' bytes, or FREE_CLASSES if none does
+static uint32_t _table_class_ceil(uint32_t size) {
+    uint32_t c = 0;
+    while (c < FREE_CLASSES && _table_class_size(c) < size) {
+        c++;
+    }
+    return c;
+}
+
+//space actually taken by a record of 'size' bytes
+static uint32_t _table_alloc_size(uint32_t size) {
+    uint32_t c = _table_class_ceil(size);
+    return c < FREE_CLASSES ? _table_class_size(c) : size;
+}
+
+//records in legacy files were allocated first fit and are only known to be as large as their contents
+static bool _table_sized(struct DB* db) {
+    return _table_version(db) != SUPER_VERSION_LEGACY;
+}
+
+static void _table_write_compact_field(struct DB* db, uint32_t field_off, uint32_t value) {
+    pager_write(db, COMPACT_OFF + field_off, &value, sizeof(uint32_t));
+}
+
+//puts 'len' bytes at 'off' on the list of the largest class it can hold
+static void _table_push_list(struct DB* db, uint32_t off, uint32_t len) {
+    if (len < FREE_CLASS_MIN)
+        return;
+
+    uint32_t c = _table_class_ceil(len);
+    uint32_t head_off;
+    if (c == FREE_CLASSES) {
+        //large records keep their size in the header for the first-fit search
+        struct Record r;
+        pager_read(db, FREE_LARGE_OFF, &r.next_off, sizeof(uint32_t));
+        r.key_len = 0;
+        r.data_len = len - REC_HEADER_SIZE_UNHASHED;
+        pager_write(db, off, &r, REC_HEADER_SIZE_UNHASHED); //next_off, key_len, data_len
+        pager_write(db, FREE_LARGE_OFF, &off, sizeof(uint32_t));
+        return;
+    }
+
+    if (_table_class_size(c) > len)
+        c--;
+    head_off = FREE_CLASS_OFF + c * sizeof(uint32_t);
+    uint32_t next;
+    pager_read(db, head_off, &next, sizeof(uint32_t));
+    pager_write(db, off, &next, sizeof(uint32_t));
+    pager_write(db, head_off, &off, sizeof(uint32_t));
+}
+
+//frees 'len' bytes at 'off'
+//during a compaction the space is left unused - the whole old heap is reclaimed at the end
+static void _table_push_free(struct DB* db, uint32_t off, uint32_t len) {
+    lock_alloc(db);
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    if (cs.phase == COMPACT_NONE)
+        _table_push_list(db, off, len);
+}
+
+//takes 'size' bytes from the front of a free piece of 'len' bytes, freeing the rest
+static uint32_t _table_carve(struct DB* db, uint32_t off, uint32_t len, uint32_t size) {
+    _table_push_free(db, off + size, len - size);
+    return off;
+}
+
+//pops a record of at least 'size' bytes from the size class lists
+static uint32_t _table_pop_class(struct DB* db, uint32_t size) {
+    uint32_t heads[FREE_CLASSES];
+    pager_read(db, FREE_CLASS_OFF, heads, sizeof(heads));
+
+    for (uint32_t c = _table_class_ceil(size); c < FREE_CLASSES; c++) {
+        if (heads[c]) {
+            uint32_t next;
+            pager_read(db, heads[c], &next, sizeof(uint32_t));
+            pager_write(db, FREE_CLASS_OFF + c * sizeof(uint32_t), &next, sizeof(uint32_t));
+            return _table_carve(db, heads[c], _table_class_size(c), size);
+        }
+    }
+    return 0;
+}
+
+//first fit on an exact-sized list - the large list, or the freelist of a legacy file
+//small legacy records that do not fit are moved to their size class as they are passed,
+//at most 'drain' of them, so the legacy list empties out over time
+static uint32_t _table_pop_first_fit(struct DB* db, uint32_t list_off, uint32_t size, uint32_t drain) {
+    uint32_t cur;
+    pager_read(db, list_off, &cur, sizeof(uint32_t));
+    uint32_t prev = list_off;
+
+    while (cur) {
+        struct Record r = _table_read_rec(db, cur, UINT32_MAX);
+        uint32_t len = REC_HEADER_SIZE_UNHASHED + r.key_len + r.data_len;
+
+        if (len >= size) {
+            pager_write(db, prev, &r.next_off, sizeof(uint32_t));
+            return _table_carve(db, cur, len, size);
+        }
+
+        if (drain && list_off == FREELIST_OFF) {
+            pager_write(db, prev, &r.next_off, sizeof(uint32_t));
+            _table_push_free(db, cur, len);
+            drain--;
+        } else {
+            prev = cur;
+        }
+        cur = r.next_off;
+    }
+
+    return 0;
+}
+
+//room a running compaction still needs to move the records up (at most all of them, with an extent to spare),
+//which writers leave free
+static uint64_t _table_reserve(struct DB* db) {
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    return cs.phase == COMPACT_MOVE_UP ? (uint64_t)cs.low_end - RECORD_OFF + HEAP_EXTENT : 0;
+}
+
+//'size' is already rounded up to its class
+//new space is carved from the extent whose tail is recorded at 'extent_off'
+//returns 0 if the heap has to grow and has no room, leaving the compaction reserve alone for a 'writer'
+static uint32_t _table_alloc_from(struct DB* db, uint32_t size, uint32_t extent_off, bool writer) {
+    lock_alloc(db);
+    uint32_t off;
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+
+    if (cs.phase == COMPACT_MOVE_DOWN || cs.phase == COMPACT_MOVE_VALUES) {
+        if (cs.frontier + size <= cs.low_end) {
+            _table_write_compact_field(db, offsetof(struct CompactState, frontier), cs.frontier + size);
+            return cs.frontier;
+        }
+        _table_write_compact_field(db, offsetof(struct CompactState, overflow), 1);
+    } else if (cs.phase == COMPACT_NONE) {
+        if (size <= _table_class_size(FREE_CLASSES - 1)) {
+            if ((off = _table_pop_class(db, size)))
+                return off;
+        } else if ((off = _table_pop_first_fit(db, FREE_LARGE_OFF, size, 0))) {
+            return off;
+        }
+
+        if ((off = _table_pop_first_fit(db, FREELIST_OFF, size, 8)))
+            return off;
+    }
+
+    //carve from the current extent, or start a new one
+    uint32_t extent[2];
+    pager_read(db, extent_off, extent, sizeof(extent));
+    if (extent[1] - extent[0] < size) {
+        uint32_t grow = _table_grow_max(size);
+        if (!pager_heap_room(db, grow + (writer ? _table_reserve(db) : 0)))
+            return 0;
+        _table_push_free(db, extent[0], extent[1] - extent[0]);
+        extent[0] = pager_grow(db, grow);
+        extent[1] = extent[0] + grow;
+    }
+    off = extent[0];
+    extent[0] += size;
+    pager_write(db, extent_off, extent, sizeof(extent));
+    return off;
+}
+
+static uint32_t _table_alloc(struct DB* db, uint32_t size) {
+    return _table_alloc_from(db, size, EXTENT_OFF, false);
+}
+
+//most the heap grows by to allocate 'size' bytes: a whole extent, or the size itself if that is larger
+static uint64_t _table_grow_max(uint64_t size) {
+    return size > HEAP_EXTENT ? size : HEAP_EXTENT;
+}
+
+//true if the heap can grow by 'len' bytes without eating into the compaction reserve, for changes that cannot
+//fail halfway; the allocator lock is taken first, so no other writer can use up the room before the caller allocates
+bool table_has_room(struct DB* db, uint64_t len) {
+    lock_alloc(db);
+    return pager_heap_room(db, len + _table_reserve(db));
+}
+
+//space taken by a new record with 'len' bytes of key and data
+static uint32_t _table_new_rec_size(struct DB* db, uint32_t len) {
+    uint32_t header_len = _table_hashed_from(db) == UINT32_MAX ? REC_HEADER_SIZE_UNHASHED : REC_HEADER_SIZE;
+    return _table_alloc_size(header_len + len);
+}
+
+//'len' is the size of the key and data
+static uint32_t _table_get_free_rec(struct DB* db, uint32_t len) {
+    return _table_alloc_from(db, _table_new_rec_size(db, len), EXTENT_OFF, true);
+}
+
+//value records are carved from extents of their own, so that the records of the chains are packed together
+//even before a compaction
+static uint32_t _table_get_value_rec(struct DB* db, uint32_t len) {
+    return _table_alloc_from(db, _table_new_rec_size(db, len), VALUE_EXTENT_OFF, true);
+}
+
+//records outside of any chain (tree engine values) are allocated and freed here too
+uint32_t table_alloc_rec(struct DB* db, uint32_t len) {
+    return _table_get_value_rec(db, len);
+}
+
+//true if the record can be rewritten in place with 'data_len' bytes of data
+//a value going into or out of a value record always takes a new record
+bool table_rec_fits(struct DB* db, struct Record r, uint32_t data_len) {
+    if (r.value_off || data_len > TABLE_INLINE_MAX)
+        return false;
+    if (!_table_sized(db))
+        return data_len <= r.data_len;
+    return _table_alloc_size(r.header_len + r.key_len + data_len) == _table_alloc_size(r.header_len + r.key_len + r.data_len);
+}
+
+//returns a record to the free lists, with its value record if it has one
+void table_free_rec(struct DB* db, uint32_t rec_off) {
+    struct Record r = table_read_rec(db, rec_off);
+    uint32_t len = r.header_len + _table_body_len(&r);
+    _table_push_free(db, rec_off, _table_sized(db) ? _table_alloc_size(len) : len);
+    if (r.value_off)
+        table_free_rec(db, r.value_off);
+}
+
+//frees 'len' unused bytes at 'off'
+void table_free_space(struct DB* db, uint32_t off, uint32_t len) {
+    _table_push_free(db, off, len);
+}
+
+//the header is written in the format of the record's place in the file, with the hash of 'key'
+//'data' is not used if the record has a value record, whose offset is written in its place
 void table_write_rec(struct DB* db, uint32_t rec_off, struct Record r, const char* key, const char* data) {
-    uint32_t len = sizeof(uint32_t) * 3 + r.key_len + r.data_len;
+    uint32_t header_len = _table_header_len(rec_off, _table_hashed_from(db));
+    uint32_t len = header_len + _table_body_len(&r);
     char buf[len];
 
     *((uint32_t*)buf) = r.next_off; 
     *((uint32_t*)(buf + sizeof(uint32_t))) = r.key_len;
-    *((uint32_t*)(buf + sizeof(uint32_t) * 2)) = r.data_len;
-    memcpy(buf + sizeof(uint32_t) * 3, key, r.key_len);
-    memcpy(buf + sizeof(uint32_t) * 3 + r.key_len, data, r.data_len);
+    *((uint32_t*)(buf + sizeof(uint32_t) * 2)) = r.data_len | (r.value_off ? REC_VALUE_OUT : 0);
+    if (header_len == REC_HEADER_SIZE)
+        *((uint32_t*)(buf + sizeof(uint32_t) * 3)) = _hash_key(key, r.key_len);
+    memcpy(buf + header_len, key, r.key_len);
+    if (r.value_off)
+        memcpy(buf + header_len + r.key_len, &r.value_off, sizeof(uint32_t));
+    else
+        memcpy(buf + header_len + r.key_len, data, r.data_len);
     pager_write(db, rec_off, buf, len);
 }
 
-void table_insert_rec(struct DB* db, const char* key, const char* data) {
-    uint32_t chain_off = _hash_key(key) % BUCKETS_MAX * sizeof(uint32_t) + HASHTAB_OFF;
+//values over TABLE_INLINE_MAX are kept in a record of their own, with an empty key and no chain, so a chain
+//only holds keys and the offsets of their values and stays small enough to be walked from the cache;
+//the value is read only once its key has been found
+//value records are freed with their records, and moved by compaction (see CompactState)
+static void _table_put_value(struct DB* db, uint32_t off, const char* data, uint32_t len) {
+    struct Record r;
+    r.next_off = 0;
+    r.key_len = 0;
+    r.data_len = len;
+    r.value_off = 0;
+    table_write_rec(db, off, r, "", data);
+}
+
+//file offset of the record's data, which follows its key or is in its value record
+uint32_t table_value_off(struct DB* db, uint32_t rec_off, struct Record* r) {
+    if (!r->value_off)
+        return rec_off + r->header_len + r->key_len;
+    return r->value_off + _table_header_len(r->value_off, _table_hashed_from(db));
+}
+
+//both records are allocated before anything is written, so if the heap is full the store is rejected with -1
+//and nothing has changed
+int table_insert_rec(struct DB* db, const char* key, uint32_t key_len, const char* data, uint32_t data_len) {
+    if ((uint64_t)REC_HEADER_SIZE + key_len + data_len > UINT32_MAX)
+        return -1;
+
+    uint32_t hash = _hash_key(key, key_len);
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t bucket = _table_bucket(&hs, hash);
+    uint32_t chain_off = _table_head_off(db, &hs, bucket);
     uint32_t head_off;
     pager_read(db, chain_off, &head_off, sizeof(uint32_t));
 
     struct Record new_rec;
     new_rec.next_off = head_off;
-    new_rec.key_len = strlen(key);
-    new_rec.data_len = strlen(data);
+    new_rec.key_len = key_len;
+    new_rec.data_len = data_len;
+    new_rec.value_off = 0;
+    if (data_len > TABLE_INLINE_MAX && !(new_rec.value_off = _table_get_value_rec(db, data_len)))
+        return -1;
 
-    uint32_t new_off = _table_get_free_rec(db, new_rec.key_len + new_rec.data_len);
+    uint32_t new_off = _table_get_free_rec(db, _table_body_len(&new_rec));
+    if (!new_off) {
+        if (new_rec.value_off)
+            _table_push_free(db, new_rec.value_off, _table_new_rec_size(db, data_len));
+        return -1;
+    }
+    if (new_rec.value_off)
+        _table_put_value(db, new_rec.value_off, data, data_len);
     pager_write(db, chain_off, &new_off, sizeof(uint32_t));
     table_write_rec(db, new_off, new_rec, key, data);
+    _table_filter_write(db, bucket, _table_filter_bits(hash), true);
+
+    //the count is covered by the allocator lock, splits are left to table_maintain
+    uint32_t rec_count;
+    lock_alloc(db);
+    pager_read(db, HASH_STATE_OFF + offsetof(struct HashState, rec_count), &rec_count, sizeof(uint32_t));
+    rec_count++;
+    pager_write(db, HASH_STATE_OFF + offsetof(struct HashState, rec_count), &rec_count, sizeof(uint32_t));
+    return 0;
 }
 
-int table_delete_rec(struct DB* db, const char* key) {
-    uint32_t chain_off = _hash_key(key) % BUCKETS_MAX * sizeof(uint32_t) + HASHTAB_OFF;
+//takes the record at 'rec_off' out of the chain of 'key', or the first record with the key if 'rec_off' is 0
+int table_delete_rec(struct DB* db, const char* key, uint32_t key_len, uint32_t rec_off) {
+    uint32_t hash = _hash_key(key, key_len);
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t bucket = _table_bucket(&hs, hash);
+    if (!_table_filter_may_hold(db, bucket, hash))
+        return -1;
+
+    uint32_t chain_off = _table_head_off(db, &hs, bucket);
     uint32_t cur;
     pager_read(db, chain_off, &cur, sizeof(uint32_t));
     uint32_t prev = chain_off;
+    uint32_t hashed_from = _table_hashed_from(db);
 
     while (cur) {
-        struct Record r = table_read_rec(db, cur);
-        char rec_key[r.key_len];
-        pager_read(db, cur + KEY_OFF, rec_key, r.key_len);
+        struct Record r = _table_read_rec(db, cur, hashed_from);
 
-        if (strncmp(rec_key, key, r.key_len) == 0) {
+        if (rec_off ? cur == rec_off : _table_rec_matches(db, cur, &r, key, key_len, hash)) {
             //remove from chain
             pager_write(db, prev, (char*)&r.next_off, sizeof(uint32_t)); 
-            //insert into freelist
-            uint32_t next_free;
-            pager_read(db, FREELIST_OFF, &next_free, sizeof(uint32_t));
-            pager_write(db, cur, &next_free, sizeof(uint32_t));
-            pager_write(db, FREELIST_OFF, &cur, sizeof(uint32_t));
+            table_free_rec(db, cur);
+            _table_filter_rebuild(db, &hs, bucket);
+
+            uint32_t rec_count;
+            pager_read(db, HASH_STATE_OFF + offsetof(struct HashState, rec_count), &rec_count, sizeof(uint32_t));
+            if (rec_count) { //files from before the count was kept start at zero
+                rec_count--;
+                pager_write(db, HASH_STATE_OFF + offsetof(struct HashState, rec_count), &rec_count, sizeof(uint32_t));
+            }
             return 0;
         }
 
@@ -112,47 +779,402 @@ int table_delete_rec(struct DB* db, const char* key) {
     return -1;
 }
 
-void table_read_metadata(struct DB* db) {
-    _fseek(db->idxf, SUPER_OFF, SEEK_SET);
-    _fread((void*)db->super->buf, sizeof(char), BLOCK_SIZE, db->idxf);
-}
-
-uint32_t table_find_rec(struct DB* db, const char* key) {
-    uint32_t chain_off = _hash_key(key) % BUCKETS_MAX * sizeof(uint32_t) + HASHTAB_OFF;
+//checks the bucket's filter, then walks the chain comparing stored hashes,
+//so most records that do not match are rejected from their header
+//the header of the record found is left in 'r', so the caller can go straight to the data
+//a lookup reads the directory entry and then each record of the chain up to the key: records are placed
+//wherever the allocator has room, so in a file that has not been compacted every hop is likely another block
+//(about 2.8 reads per lookup), while a compaction lays each chain out contiguously (about 1.9)
+uint32_t table_find_rec(struct DB* db, const char* key, uint32_t key_len, struct Record* r) {
+    uint32_t hash = _hash_key(key, key_len);
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t bucket = _table_bucket(&hs, hash);
     uint32_t rec_off;
-    pager_read(db, chain_off, &rec_off, sizeof(uint32_t));
+    if (!_table_chain_start(db, &hs, bucket, hash, &rec_off))
+        return 0;
+    uint32_t hashed_from = _table_hashed_from(db);
 
     while (rec_off) {
-        struct Record r = table_read_rec(db, rec_off);
-        char rec_key[r.key_len];
-        pager_read(db, rec_off + KEY_OFF, rec_key, r.key_len);
+        *r = _table_read_rec(db, rec_off, hashed_from);
 
-        if (strncmp(rec_key, key, r.key_len) == 0)
+        if (_table_rec_matches(db, rec_off, r, key, key_len, hash))
             return rec_off;
-        rec_off = r.next_off;
+        rec_off = r->next_off;
     }
 
     return 0;
 }
 
+//table_find_rec for 'count' keys at once, setting rec_offs[i] (0 if there is no such key) and recs[i] for keys[i]
+//the chains are walked side by side a level at a time - every key's directory entry (or chain head), then every
+//first record, and so on - and each level is loaded in file order, the blocks it is missing read together
+//with HASH_LOAD_MAX records to a chain, most keys are found within two levels
+void table_find_many(struct DB* db, const struct DbSlice* keys, uint32_t count, uint32_t* rec_offs, struct Record* recs) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t hashed_from = _table_hashed_from(db);
+    struct PagerRange* ranges = _malloc(count * sizeof(struct PagerRange));
+    uint32_t* hashes = _malloc(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        hashes[i] = _hash_key(keys[i].data, keys[i].len);
+        uint32_t bucket = _table_bucket(&hs, hashes[i]);
+        ranges[i] = (struct PagerRange){ _table_head_off(db, &hs, bucket), sizeof(uint32_t), i };
+        rec_offs[i] = 0;
+    }
+
+    bool heads = true;
+    uint32_t n = count;
+    while (n) {
+        pager_sort_ranges(ranges, n);
+        uint32_t next = 0; //ranges of the next level replace those of this one, never more than one each
+        for (uint32_t done = 0; done < n; ) {
+            uint32_t loaded = done + pager_load(db, ranges + done, n - done);
+            for (; done < loaded; done++) {
+                uint32_t off = ranges[done].off;
+                uint32_t i = ranges[done].tag;
+                uint32_t cur;
+                if (heads) {
+                    if (!_table_chain_start(db, &hs, _table_bucket(&hs, hashes[i]), hashes[i], &cur))
+                        continue;
+                } else {
+                    struct Record r = _table_read_rec(db, off, hashed_from);
+                    if (_table_rec_matches(db, off, &r, keys[i].data, keys[i].len, hashes[i])) {
+                        rec_offs[i] = off;
+                        recs[i] = r;
+                        continue;
+                    }
+                    cur = r.next_off;
+                }
+                if (cur)
+                    ranges[next++] = (struct PagerRange){ cur, REC_HEADER_SIZE + keys[i].len, i };
+            }
+        }
+        n = next;
+        heads = false;
+    }
+
+    free(ranges);
+    free(hashes);
+}
+
+//true if table_maintain has work to do
+bool table_maintenance_due(struct DB* db) {
+    struct HashState hs;
+    struct CompactState cs;
+    struct DirState ds;
+    _table_read_state(db, &hs);
+    _table_read_compact(db, &cs);
+    _table_read_dir(db, &ds);
+    return _table_split_due(&hs) || cs.phase != COMPACT_NONE || _table_version(db) < SUPER_VERSION || !ds.valid;
+}
+
+//changes to the table layout, made after each write with the whole file locked:
+//splits buckets in order until the table is back under its load, at most HASH_SPLIT_BATCH of them at once,
+//and carries a running compaction along
+void table_maintain(struct DB* db) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    if (_table_split_due(&hs)) {
+        for (uint32_t i = 0; i < HASH_SPLIT_BATCH && _table_split_due(&hs); i++) {
+            if (!_table_split(db, &hs))
+                break;
+        }
+        pager_write(db, HASH_STATE_OFF, &hs, sizeof(struct HashState));
+    }
+
+    table_compact_step(db, COMPACT_STEP, false);
+}
+
 void table_commit(struct DB* db) {
+    pager_commit(db);
+}
+
+void table_abort(struct DB* db) {
+    pager_abort(db);
+}
+
+static void _table_copy(struct DB* db, uint32_t to, uint32_t from, uint32_t len) {
+    char buf[BLOCK_SIZE];
+    for (uint32_t done = 0; done < len; done += BLOCK_SIZE) {
+        uint32_t n = len - done < BLOCK_SIZE ? len - done : BLOCK_SIZE;
+        pager_read(db, from + done, buf, n);
+        pager_write(db, to + done, buf, n);
+    }
+}
+
+//new place for 'size' bytes at 'off', or 0 if they are already where the current phase wants them
+//(or MOVE_DOWN has run out of room in front of low_end)
+static uint32_t _table_compact_dest(struct DB* db, uint32_t off, uint32_t size) {
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    if (cs.phase == COMPACT_MOVE_UP ? off >= cs.low_end : off < cs.low_end)
+        return 0;
+
+    if (cs.phase != COMPACT_MOVE_UP && cs.frontier + size > cs.low_end) {
+        _table_write_compact_field(db, offsetof(struct CompactState, overflow), 1);
+        return 0;
+    }
+    return _table_alloc(db, size);
+}
+
+//moves the segment at 'seg_off' (recorded at 'ref_off') if it is in the wrong place, to a multiple of 'align'
+//a segment MOVE_UP has no room for yet stays put, but still counts as moved so the step ends there
+static bool _table_compact_seg(struct DB* db, uint32_t ref_off, uint32_t seg_off, uint32_t size, uint32_t align) {
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    if (cs.phase == COMPACT_MOVE_UP && seg_off < cs.low_end && !pager_heap_room(db, _table_grow_max(size + align)))
+        return true;
+
+    uint32_t dest = _table_compact_dest(db, seg_off, size + align - 1);
+    if (!dest)
+        return false;
+    dest = (dest + align - 1) / align * align;
+
+    _table_copy(db, dest, seg_off, size);
+    pager_write(db, ref_off, &dest, sizeof(uint32_t));
+    return true;
+}
+
+//moves the first hash, filter or directory segment that is in the wrong place, returns false if there is none
+//while the directory is being built, the heads and filters it replaces are not brought down
+static bool _table_compact_segment(struct DB* db) {
+    struct HashState hs;
+    struct FilterState fs;
+    struct DirState ds;
+    struct CompactState cs;
+    _table_read_state(db, &hs);
+    _table_read_filter(db, &fs);
+    _table_read_dir(db, &ds);
+    _table_read_compact(db, &cs);
+    if (cs.phase != COMPACT_MOVE_UP && ds.seg_off[0] && !ds.valid) {
+        memset(hs.seg_off, 0, sizeof(hs.seg_off));
+        memset(fs.seg_off, 0, sizeof(fs.seg_off));
+    }
+    for (uint32_t seg = 0; seg < HASH_SEGMENTS_MAX; seg++) {
+        uint32_t buckets = seg ? BUCKETS_INIT << (seg - 1) : BUCKETS_INIT;
+        uint32_t ref_off = HASH_STATE_OFF + offsetof(struct HashState, seg_off) + seg * sizeof(uint32_t);
+        if (seg && hs.seg_off[seg] && _table_compact_seg(db, ref_off, hs.seg_off[seg], buckets * sizeof(uint32_t), 1))
+            return true;
+
+        ref_off = FILTER_OFF + offsetof(struct FilterState, seg_off) + seg * sizeof(uint32_t);
+        if (fs.seg_off[seg] && _table_compact_seg(db, ref_off, fs.seg_off[seg], buckets * sizeof(uint64_t), 1))
+            return true;
+
+        ref_off = DIR_OFF + offsetof(struct DirState, seg_off) + seg * sizeof(uint32_t);
+        if (ds.seg_off[seg] && _table_compact_seg(db, ref_off, ds.seg_off[seg], buckets * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE))
+            return true;
+    }
+    return false;
+}
+
+//copies the record at 'off' to 'dest', rewriting its header if it goes into the format with a hash
+//returns false if it stays where it is
+static bool _table_compact_rec(struct DB* db, uint32_t off, struct Record* r, uint32_t dest_header_len, uint32_t* dest) {
+    uint32_t body_len = _table_body_len(r);
+    if (!(*dest = _table_compact_dest(db, off, _table_alloc_size(dest_header_len + body_len))))
+        return false;
+
+    if (dest_header_len == r->header_len) {
+        _table_copy(db, *dest, off, r->header_len + body_len);
+    } else {
+        uint32_t data_len = r->data_len | (r->value_off ? REC_VALUE_OUT : 0);
+        uint32_t header[4] = {r->next_off, r->key_len, data_len, _table_rec_hash(db, off, r)};
+        pager_write(db, *dest, header, REC_HEADER_SIZE);
+        _table_copy(db, *dest + REC_HEADER_SIZE, off + r->header_len, body_len);
+    }
+    return true;
+}
+
+//heap MOVE_UP may need to move the chain of 'bucket': its records and their value records at the size they
+//take in 'header_len' format, and the tail of the extent they start
+static uint64_t _table_chain_grow(struct DB* db, uint32_t bucket, uint32_t header_len) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t cur;
+    pager_read(db, _table_head_off(db, &hs, bucket), &cur, sizeof(uint32_t));
+    uint32_t hashed_from = _table_hashed_from(db);
+    uint64_t grow = HEAP_EXTENT;
+    while (cur) {
+        struct Record r = _table_read_rec(db, cur, hashed_from);
+        grow += _table_alloc_size(header_len + _table_body_len(&r));
+        if (r.value_off)
+            grow += _table_alloc_size(header_len + r.data_len);
+        cur = r.next_off;
+    }
+    return grow;
+}
+
+//moves the records of one chain, returns how many were moved
+//value records go up with their records but only come down in MOVE_VALUES
+//MOVE_DOWN recomputes the chain's filter, moving it into the directory with the head while that is being built
+static uint32_t _table_compact_bucket(struct DB* db, uint32_t bucket) {
+    struct HashState hs;
+    _table_read_state(db, &hs);
+    uint32_t prev = _table_head_off(db, &hs, bucket);
+    uint32_t cur;
+    pager_read(db, prev, &cur, sizeof(uint32_t));
+
+    struct CompactState cs;
+    _table_read_compact(db, &cs);
+    uint32_t hashed_from = _table_hashed_from(db);
+    uint32_t dest_header_len = _table_header_len(cs.phase == COMPACT_MOVE_UP ? cs.low_end : RECORD_OFF, hashed_from);
 
-    struct Block* cur = db->blocks;
+    uint32_t moved = 0;
+    uint64_t filter = 0;
     while (cur) {
-        if (cur->dirty) {
-            pager_commit_block(db, cur);
-            /*testing*/
-            //printf("block %u\n", cur->idx);
-            //_fseek(db->idxf, 0, SEEK_END);
-            //uint32_t max = _ftell(db->idxf) - cur->idx * BLOCK_SIZE;
-            //_fseek(db->idxf, cur->idx * BLOCK_SIZE, SEEK_SET);
-            //printf("commiting %u bytes from block %u\n", max < BLOCK_SIZE ? max : BLOCK_SIZE, cur->idx);
-            /*end testing*/
-
-            cur->dirty = false;
+        struct Record r = _table_read_rec(db, cur, hashed_from);
+        if (cs.phase == COMPACT_MOVE_DOWN)
+            filter |= _table_filter_bits(_table_rec_hash(db, cur, &r));
+        uint32_t dest;
+        if (cs.phase != COMPACT_MOVE_VALUES && _table_compact_rec(db, cur, &r, dest_header_len, &dest)) {
+            pager_write(db, prev, &dest, sizeof(uint32_t));
+            cur = dest;
+            r.header_len = dest_header_len;
+            moved++;
+        }
+        if (r.value_off && cs.phase != COMPACT_MOVE_DOWN) {
+            struct Record v = _table_read_rec(db, r.value_off, hashed_from);
+            if (_table_compact_rec(db, r.value_off, &v, dest_header_len, &dest)) {
+                pager_write(db, cur + r.header_len + r.key_len, &dest, sizeof(uint32_t));
+                moved++;
+            }
+        }
+        prev = cur; //next_off is the first field of a record
+        cur = r.next_off;
+    }
+
+    if (cs.phase == COMPACT_MOVE_DOWN) {
+        _table_filter_write(db, bucket, filter, false);
+
+        struct DirState ds;
+        _table_read_dir(db, &ds);
+        if (ds.seg_off[0] && !_table_in_dir(db, &ds, bucket)) {
+            struct DirEntry e = {filter, 0, 0};
+            pager_read(db, _table_head_off(db, &hs, bucket), &e.head, sizeof(uint32_t));
+            pager_write(db, _table_dir_off(&ds, bucket), &e, sizeof(struct DirEntry));
         }
-        cur = cur->next;
     }
+    return moved;
+}
+
+//frees the chain heads and filters the directory has taken over, but for the first BUCKETS_INIT heads
+//nothing refers to them once the directory is valid, so those still inside the heap go straight onto the free
+//lists (the others were left past low_end and have just been cut off with it)
+static void _table_free_old_index(struct DB* db) {
+    struct HashState hs;
+    struct FilterState fs;
+    uint32_t heap_end;
+    _table_read_state(db, &hs);
+    _table_read_filter(db, &fs);
+    pager_read(db, HEAP_END_OFF, &heap_end, sizeof(uint32_t));
+    for (uint32_t seg = 0; seg < HASH_SEGMENTS_MAX; seg++) {
+        uint32_t buckets = seg ? BUCKETS_INIT << (seg - 1) : BUCKETS_INIT;
+        if (seg && hs.seg_off[seg] && hs.seg_off[seg] < heap_end)
+            _table_push_list(db, hs.seg_off[seg], buckets * sizeof(uint32_t));
+        if (fs.seg_off[seg] && fs.seg_off[seg] < heap_end)
+            _table_push_list(db, fs.seg_off[seg], buckets * sizeof(uint64_t));
+    }
+    memset(hs.seg_off, 0, sizeof(hs.seg_off));
+    memset(&fs, 0, sizeof(struct FilterState));
+    pager_write(db, HASH_STATE_OFF + offsetof(struct HashState, seg_off), hs.seg_off, sizeof(hs.seg_off));
+    pager_write(db, FILTER_OFF, &fs, sizeof(struct FilterState));
+}
 
-    pager_commit_block(db, db->super);
+//runs one bounded step of online compaction, moving about 'budget' records (or one hash segment)
+//starts a compaction if none is running and 'start' is set, or if the file still has records without hashes
+//or has no directory
+//returns true while the compaction has more steps to go
+//records are all reallocated at their class size, so a legacy file is upgraded once it is compacted
+bool table_compact_step(struct DB* db, uint32_t budget, bool start) {
+    struct CompactState cs;
+    struct DirState ds;
+    _table_read_compact(db, &cs);
+    _table_read_dir(db, &ds);
+    if (cs.phase == COMPACT_NONE) {
+        if (!start && _table_version(db) >= SUPER_VERSION && ds.valid)
+            return false;
+
+        //MOVE_UP copies the heap past its end, so a compaction only starts with room for that twice over
+        //(records of older files grow as they get hashes); a full file is left as it is
+        uint32_t heap_end;
+        pager_read(db, HEAP_END_OFF, &heap_end, sizeof(uint32_t));
+        uint64_t grow = 2 * ((uint64_t)heap_end - RECORD_OFF);
+        struct HashState hs;
+        _table_read_state(db, &hs);
+        for (uint32_t seg = 0; !ds.valid && seg < HASH_SEGMENTS_MAX && (seg == 0 || hs.seg_off[seg]); seg++) {
+            if (!ds.seg_off[seg])
+                grow += _table_grow_max((uint64_t)((seg ? BUCKETS_INIT << (seg - 1) : BUCKETS_INIT) + 1) * DIR_ENTRY_SIZE);
+        }
+        if (!table_has_room(db, grow))
+            return false;
+
+        //free lists and the extent tails all point into the old heap
+        uint32_t zero[FREE_CLASSES + 3] = {0};
+        pager_write(db, FREE_CLASS_OFF, zero, sizeof(zero));
+        pager_write(db, FREELIST_OFF, zero, sizeof(uint32_t));
+        pager_write(db, VALUE_EXTENT_OFF, zero, sizeof(uint32_t) * 2);
+
+        cs.phase = COMPACT_MOVE_UP;
+        cs.bucket = 0;
+        cs.low_end = heap_end;
+        cs.frontier = RECORD_OFF;
+        cs.overflow = 0;
+        cs.rehash = _table_version(db) < SUPER_VERSION;
+        pager_write(db, COMPACT_OFF, &cs, sizeof(struct CompactState));
+
+        //the directory is filled in by MOVE_DOWN and by splits, until then buckets are looked up the old way
+        if (!ds.valid) {
+            for (uint32_t seg = 0; seg < HASH_SEGMENTS_MAX && (seg == 0 || hs.seg_off[seg]); seg++) {
+                if (!ds.seg_off[seg]) {
+                    uint32_t buckets = seg ? BUCKETS_INIT << (seg - 1) : BUCKETS_INIT;
+                    ds.seg_off[seg] = _table_alloc_dir(db, buckets);
+                }
+            }
+            pager_write(db, DIR_OFF, &ds, sizeof(struct DirState));
+        }
+    }
+
+    if (_table_compact_segment(db))
+        return true;
+
+    uint32_t moved = 0;
+    uint32_t bucket_count = table_bucket_count(db);
+    uint32_t up_header_len = _table_header_len(cs.low_end, _table_hashed_from(db));
+    while (cs.bucket < bucket_count) {
+        //MOVE_UP cannot leave a record behind, so it waits for room (writers keep it free, see table_has_room)
+        if (cs.phase == COMPACT_MOVE_UP && !pager_heap_room(db, _table_chain_grow(db, cs.bucket, up_header_len)))
+            break;
+        moved += _table_compact_bucket(db, cs.bucket++);
+        if (moved >= budget)
+            break;
+    }
+    _table_write_compact_field(db, offsetof(struct CompactState, bucket), cs.bucket);
+    if (cs.bucket < bucket_count)
+        return true;
+
+    if (cs.phase == COMPACT_MOVE_UP || cs.phase == COMPACT_MOVE_DOWN) {
+        _table_write_compact_field(db, offsetof(struct CompactState, phase), cs.phase + 1);
+        _table_write_compact_field(db, offsetof(struct CompactState, bucket), 0);
+        return true;
+    }
+
+    _table_read_compact(db, &cs);
+    if (!cs.overflow) {
+        pager_write(db, HEAP_END_OFF, &cs.frontier, sizeof(uint32_t));
+        uint32_t extent[2] = {0, 0};
+        pager_write(db, EXTENT_OFF, extent, sizeof(extent));
+        pager_write(db, VALUE_EXTENT_OFF, extent, sizeof(extent));
+    }
+    //a compaction left running by an older version of this code did not add hashes
+    uint32_t version = cs.rehash || _table_version(db) >= SUPER_VERSION ? SUPER_VERSION : SUPER_VERSION_UNHASHED;
+    pager_write(db, VERSION_OFF, &version, sizeof(uint32_t));
+    _table_read_dir(db, &ds);
+    if (ds.seg_off[0] && !ds.valid) { //not if an older version of this code started the compaction
+        _table_free_old_index(db);
+        ds.valid = 1;
+        pager_write(db, DIR_OFF + offsetof(struct DirState, valid), &ds.valid, sizeof(uint32_t));
+    }
+    _table_write_compact_field(db, offsetof(struct CompactState, phase), COMPACT_NONE);
+    return false;
 }
@@ -1,20 +1,40 @@
 #ifndef UDB_TABLE_H
 #define UDB_TABLE_H
 
+#include <stdbool.h>
+
 #include "urchin.h"
 
+#define TABLE_INLINE_MAX 512 //larger values are kept in a value record outside the chain
+
 struct Record {
     uint32_t next_off;
     uint32_t key_len;
     uint32_t data_len;
+    uint32_t hash; //FNV hash of the key
+    uint32_t header_len; //not stored - REC_HEADER_SIZE, or REC_HEADER_SIZE_UNHASHED for records without a hash
+    uint32_t value_off; //value record holding the data, stored after the key in its place, or 0 if the data is inline
 };
 
 struct Record table_read_rec(struct DB* db, uint32_t rec_off);
+uint32_t table_alloc_rec(struct DB* db, uint32_t len);
+bool table_rec_fits(struct DB* db, struct Record r, uint32_t data_len);
+void table_free_rec(struct DB* db, uint32_t rec_off);
+void table_free_space(struct DB* db, uint32_t off, uint32_t len);
 void table_write_rec(struct DB* db, uint32_t rec_off, struct Record r, const char* key, const char* data);
-void table_insert_rec(struct DB* db, const char* key, const char* data);
-int table_delete_rec(struct DB* db, const char* key);
-void table_read_metadata(struct DB* db);
-uint32_t table_find_rec(struct DB* db, const char* key);
+uint32_t table_value_off(struct DB* db, uint32_t rec_off, struct Record* r);
+bool table_has_room(struct DB* db, uint64_t len);
+int table_insert_rec(struct DB* db, const char* key, uint32_t key_len, const char* data, uint32_t data_len);
+int table_delete_rec(struct DB* db, const char* key, uint32_t key_len, uint32_t rec_off);
+uint32_t table_find_rec(struct DB* db, const char* key, uint32_t key_len, struct Record* r);
+void table_find_many(struct DB* db, const struct DbSlice* keys, uint32_t count, uint32_t* rec_offs, struct Record* recs);
+uint32_t table_key_bucket(struct DB* db, const char* key, uint32_t key_len);
+uint32_t table_bucket_count(struct DB* db);
+uint32_t table_bucket_head(struct DB* db, uint32_t bucket);
+bool table_compact_step(struct DB* db, uint32_t budget, bool start);
+bool table_maintenance_due(struct DB* db);
+void table_maintain(struct DB* db);
 void table_commit(struct DB* db);
+void table_abort(struct DB* db);
 
 #endif //UDB_TABLE_H
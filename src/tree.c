@@ -0,0 +1,656 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "tree.h"
+#include "table.h"
+#include "util.h"
+
+#define LEAF_ENTRY_HDR (sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint32_t))
+#define INTERNAL_ENTRY_HDR (sizeof(uint16_t) + sizeof(uint32_t))
+
+//a node decoded to full keys, used when a node is changed and written back
+struct TreeEntry {
+    const char* key;
+    uint32_t key_len;
+    const char* value; //NULL if the value is in the heap record 'ref'
+    uint32_t value_len;
+    uint32_t ref; //child for internal nodes, value record for leaves
+};
+
+struct TreeNode {
+    bool leaf;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t child0;
+    uint32_t count;
+    struct TreeEntry e[TREE_ENTRIES_MAX + 1];
+    char* keys;
+};
+
+//an entry as stored in a node
+struct TreeSlot {
+    const char* suffix;
+    uint32_t suffix_len;
+    const char* value;
+    uint32_t value_len;
+    uint32_t ref;
+};
+
+static uint16_t _tree_u16(const char* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(uint16_t));
+    return v;
+}
+
+static uint32_t _tree_u32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+static int _tree_cmp(const char* a, uint32_t a_len, const char* b, uint32_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c)
+        return c;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static uint32_t _tree_lcp(const char* a, uint32_t a_len, const char* b, uint32_t b_len) {
+    uint32_t i = 0;
+    while (i < a_len && i < b_len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static void _tree_slot(const char* page, uint32_t slot, struct TreeSlot* s) {
+    const struct TreeHeader* h = (const struct TreeHeader*)page;
+    const char* ent = page + _tree_u16(page + sizeof(struct TreeHeader) + h->prefix_len + slot * sizeof(uint16_t));
+
+    s->suffix_len = _tree_u16(ent);
+    if (h->leaf) {
+        bool overflow = ent[sizeof(uint16_t)];
+        s->value_len = _tree_u32(ent + sizeof(uint16_t) + sizeof(uint8_t));
+        s->suffix = ent + LEAF_ENTRY_HDR;
+        s->value = overflow ? NULL : s->suffix + s->suffix_len;
+        s->ref = overflow ? _tree_u32(s->suffix + s->suffix_len) : 0;
+    } else {
+        s->ref = _tree_u32(ent + sizeof(uint16_t));
+        s->suffix = ent + INTERNAL_ENTRY_HDR;
+        s->value = NULL;
+        s->value_len = 0;
+    }
+}
+
+//compares 'key' with the key in 'slot'
+static int _tree_cmp_slot(const char* page, uint32_t slot, const char* key, uint32_t len) {
+    const struct TreeHeader* h = (const struct TreeHeader*)page;
+    uint32_t prefix_len = h->prefix_len;
+    int c = memcmp(key, page + sizeof(struct TreeHeader), len < prefix_len ? len : prefix_len);
+    if (c)
+        return c;
+    if (len < prefix_len)
+        return -1;
+
+    struct TreeSlot s;
+    _tree_slot(page, slot, &s);
+    return _tree_cmp(key + prefix_len, len - prefix_len, s.suffix, s.suffix_len);
+}
+
+//index of the first entry >= key, or > key if 'strict'
+static uint32_t _tree_search(const char* page, const char* key, uint32_t len, bool strict) {
+    uint32_t lo = 0;
+    uint32_t hi = ((const struct TreeHeader*)page)->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = _tree_cmp_slot(page, mid, key, len);
+        if (c > 0 || (strict && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static uint32_t _tree_child(const char* page, uint32_t idx) {
+    if (idx == 0)
+        return ((const struct TreeHeader*)page)->child0;
+
+    struct TreeSlot s;
+    _tree_slot(page, idx - 1, &s);
+    return s.ref;
+}
+
+//copies the full key in 'slot' to 'buf' and returns its length
+static uint32_t _tree_slot_key(const char* page, uint32_t slot, char* buf) {
+    const struct TreeHeader* h = (const struct TreeHeader*)page;
+    struct TreeSlot s;
+    _tree_slot(page, slot, &s);
+    memcpy(buf, page + sizeof(struct TreeHeader), h->prefix_len);
+    memcpy(buf + h->prefix_len, s.suffix, s.suffix_len);
+    return h->prefix_len + s.suffix_len;
+}
+
+static void _tree_decode(const char* page, struct TreeNode* n) {
+    const struct TreeHeader* h = (const struct TreeHeader*)page;
+    n->leaf = h->leaf;
+    n->next = h->next;
+    n->prev = h->prev;
+    n->child0 = h->child0;
+    n->count = h->count;
+    n->keys = _malloc(h->count * h->prefix_len + BLOCK_SIZE);
+
+    char* k = n->keys;
+    for (uint32_t i = 0; i < n->count; i++) {
+        struct TreeSlot s;
+        _tree_slot(page, i, &s);
+        struct TreeEntry* e = &n->e[i];
+        e->key = k;
+        e->key_len = h->prefix_len + s.suffix_len;
+        e->value = s.value;
+        e->value_len = s.value_len;
+        e->ref = s.ref;
+        memcpy(k, page + sizeof(struct TreeHeader), h->prefix_len);
+        memcpy(k + h->prefix_len, s.suffix, s.suffix_len);
+        k += e->key_len;
+    }
+}
+
+//bytes taken by an entry and its slot
+static uint32_t _tree_entry_size(struct TreeNode* n, struct TreeEntry* e, uint32_t prefix_len) {
+    uint32_t size = sizeof(uint16_t) + e->key_len - prefix_len;
+    if (n->leaf) {
+        size += LEAF_ENTRY_HDR + (e->value ? e->value_len : sizeof(uint32_t));
+    } else {
+        size += INTERNAL_ENTRY_HDR;
+    }
+    return size;
+}
+
+//keys are sorted, so the prefix shared by a range of entries is the one shared by its first and last key
+static uint32_t _tree_prefix_len(struct TreeNode* n, uint32_t from, uint32_t to) {
+    if (from == to)
+        return 0;
+    return _tree_lcp(n->e[from].key, n->e[from].key_len, n->e[to - 1].key, n->e[to - 1].key_len);
+}
+
+static uint32_t _tree_node_size(struct TreeNode* n, uint32_t from, uint32_t to) {
+    uint32_t prefix_len = _tree_prefix_len(n, from, to);
+    uint32_t size = sizeof(struct TreeHeader) + prefix_len;
+    for (uint32_t i = from; i < to; i++) {
+        size += _tree_entry_size(n, &n->e[i], prefix_len);
+    }
+    return size;
+}
+
+//writes an entry (without its slot) at 'ent'
+static void _tree_put_entry(char* ent, bool leaf, struct TreeEntry* e, uint32_t prefix_len) {
+    uint16_t suffix_len = e->key_len - prefix_len;
+    memcpy(ent, &suffix_len, sizeof(uint16_t));
+    if (leaf) {
+        ent[sizeof(uint16_t)] = e->value == NULL;
+        memcpy(ent + sizeof(uint16_t) + sizeof(uint8_t), &e->value_len, sizeof(uint32_t));
+        memcpy(ent + LEAF_ENTRY_HDR, e->key + prefix_len, suffix_len);
+        if (e->value) {
+            memcpy(ent + LEAF_ENTRY_HDR + suffix_len, e->value, e->value_len);
+        } else {
+            memcpy(ent + LEAF_ENTRY_HDR + suffix_len, &e->ref, sizeof(uint32_t));
+        }
+    } else {
+        memcpy(ent + sizeof(uint16_t), &e->ref, sizeof(uint32_t));
+        memcpy(ent + INTERNAL_ENTRY_HDR, e->key + prefix_len, suffix_len);
+    }
+}
+
+//entries are packed from the end of the block in key order
+static void _tree_encode(struct TreeNode* n, uint32_t from, uint32_t to, uint32_t child0, char* page) {
+    memset(page, 0, BLOCK_SIZE);
+    uint32_t prefix_len = _tree_prefix_len(n, from, to);
+
+    struct TreeHeader* h = (struct TreeHeader*)page;
+    h->leaf = n->leaf;
+    h->count = to - from;
+    h->prefix_len = prefix_len;
+    h->child0 = child0;
+    if (from < to)
+        memcpy(page + sizeof(struct TreeHeader), n->e[from].key, prefix_len);
+
+    char* slots = page + sizeof(struct TreeHeader) + prefix_len;
+    uint32_t end = BLOCK_SIZE;
+    for (uint32_t i = from; i < to; i++) {
+        end -= _tree_entry_size(n, &n->e[i], prefix_len) - sizeof(uint16_t);
+        _tree_put_entry(page + end, n->leaf, &n->e[i], prefix_len);
+
+        uint16_t slot = end;
+        memcpy(slots + (i - from) * sizeof(uint16_t), &slot, sizeof(uint16_t));
+    }
+    h->data_start = end;
+}
+
+//adds a leaf entry in place: the entry goes below the others and only the slot array shifts,
+//so the change logged is small - fails if the key does not share the node prefix or there is no room
+static bool _tree_leaf_insert(char* page, uint32_t idx, struct TreeEntry* e) {
+    struct TreeHeader* h = (struct TreeHeader*)page;
+    uint32_t prefix_len = h->prefix_len;
+    if (e->key_len < prefix_len || memcmp(e->key, page + sizeof(struct TreeHeader), prefix_len) != 0)
+        return false;
+
+    uint32_t size = sizeof(uint16_t) + e->key_len - prefix_len + LEAF_ENTRY_HDR + (e->value ? e->value_len : sizeof(uint32_t));
+    char* slots = page + sizeof(struct TreeHeader) + prefix_len;
+    if (sizeof(struct TreeHeader) + prefix_len + h->count * sizeof(uint16_t) + size > h->data_start)
+        return false;
+
+    h->data_start -= size - sizeof(uint16_t);
+    _tree_put_entry(page + h->data_start, true, e, prefix_len);
+    memmove(slots + (idx + 1) * sizeof(uint16_t), slots + idx * sizeof(uint16_t), (h->count - idx) * sizeof(uint16_t));
+    uint16_t slot = h->data_start;
+    memcpy(slots + idx * sizeof(uint16_t), &slot, sizeof(uint16_t));
+    h->count++;
+    return true;
+}
+
+//drops a slot, leaving its entry as garbage until the node is next rewritten in full
+static void _tree_remove_slot(char* page, uint32_t idx) {
+    struct TreeHeader* h = (struct TreeHeader*)page;
+    char* slots = page + sizeof(struct TreeHeader) + h->prefix_len;
+    memmove(slots + idx * sizeof(uint16_t), slots + (idx + 1) * sizeof(uint16_t), (h->count - idx - 1) * sizeof(uint16_t));
+    h->count--;
+    memset(slots + h->count * sizeof(uint16_t), 0, sizeof(uint16_t));
+}
+
+//logs only the bytes that changed
+static void _tree_write_page(struct DB* db, uint32_t off, const char* old, char* page) {
+    uint32_t lo = 0;
+    uint32_t hi = BLOCK_SIZE;
+    while (lo < hi && old[lo] == page[lo]) {
+        lo++;
+    }
+    while (hi > lo && old[hi - 1] == page[hi - 1]) {
+        hi--;
+    }
+    if (lo < hi)
+        pager_write(db, off + lo, page + lo, hi - lo);
+}
+
+//nodes are block aligned so each one is read and logged as a single block
+//the gap left in front of the node goes to the record freelist
+static uint32_t _tree_alloc_page(struct DB* db) {
+    uint32_t end;
+    pager_read(db, HEAP_END_OFF, &end, sizeof(uint32_t));
+    uint32_t pad = (BLOCK_SIZE - end % BLOCK_SIZE) % BLOCK_SIZE;
+    uint32_t off = pager_grow(db, pad + BLOCK_SIZE);
+    table_free_space(db, off, pad);
+    return off + pad;
+}
+
+static uint32_t _tree_put_value(struct DB* db, const char* value, uint32_t len) {
+    struct Record r;
+    r.next_off = 0;
+    r.key_len = 0;
+    r.data_len = len;
+    r.value_off = 0;
+    uint32_t off = table_alloc_rec(db, len);
+    table_write_rec(db, off, r, "", value);
+    return off;
+}
+
+//descends to the leaf that would hold 'key', recording each internal node passed and the child taken
+//returns 0 if the tree is empty
+static uint32_t _tree_find_leaf(struct DB* db, const char* key, uint32_t len, char* page,
+                                uint32_t* path, uint32_t* path_idx, uint32_t* depth) {
+    uint32_t off;
+    uint32_t d = 0;
+    pager_read(db, TREE_ROOT_OFF, &off, sizeof(uint32_t));
+
+    while (off) {
+        pager_read(db, off, page, BLOCK_SIZE);
+        if (((struct TreeHeader*)page)->leaf)
+            break;
+
+        uint32_t idx = _tree_search(page, key, len, true);
+        if (path) {
+            if (d == TREE_DEPTH_MAX)
+                err_quit("tree too deep");
+            path[d] = off;
+            path_idx[d] = idx;
+        }
+        d++;
+        off = _tree_child(page, idx);
+    }
+
+    if (depth)
+        *depth = d;
+    return off;
+}
+
+//moves to the next leaf while 'slot' is past the end of the current one
+static bool _tree_leaf_walk(struct DB* db, uint32_t* off, char* page, uint32_t* slot) {
+    struct TreeHeader* h = (struct TreeHeader*)page;
+    while (*slot >= h->count) {
+        if (!h->next)
+            return false;
+        *off = h->next;
+        pager_read(db, *off, page, BLOCK_SIZE);
+        *slot = 0;
+    }
+    return true;
+}
+
+//splits the node at 'off' upwards until every node fits, then writes it back
+//'old' holds the node as it is in the file
+//leaf separators are cut to the shortest key above the left half (suffix truncation)
+static void _tree_update(struct DB* db, uint32_t off, char* old, struct TreeNode* n,
+                         uint32_t* path, uint32_t* path_idx, uint32_t depth) {
+    char buf[BLOCK_SIZE];
+    char seps[2][TREE_KEY_MAX];
+    uint32_t cur_sep = 0;
+
+    while (_tree_node_size(n, 0, n->count) > BLOCK_SIZE) {
+        uint32_t total = 0;
+        for (uint32_t i = 0; i < n->count; i++) {
+            total += _tree_entry_size(n, &n->e[i], 0);
+        }
+        uint32_t half = 0;
+        uint32_t m = 0;
+        while (m < n->count - 1 && half + _tree_entry_size(n, &n->e[m], 0) <= total / 2) {
+            half += _tree_entry_size(n, &n->e[m], 0);
+            m++;
+        }
+        if (m == 0)
+            m = 1;
+
+        uint32_t right_from = n->leaf ? m : m + 1;
+        if (_tree_node_size(n, 0, m) > BLOCK_SIZE || _tree_node_size(n, right_from, n->count) > BLOCK_SIZE)
+            err_quit("tree node split failed");
+
+        char* sep = seps[cur_sep];
+        cur_sep ^= 1;
+        uint32_t sep_len;
+        if (n->leaf) {
+            struct TreeEntry* l = &n->e[m - 1];
+            sep_len = _tree_lcp(l->key, l->key_len, n->e[m].key, n->e[m].key_len) + 1;
+        } else {
+            sep_len = n->e[m].key_len;
+        }
+        memcpy(sep, n->e[m].key, sep_len);
+
+        uint32_t right = _tree_alloc_page(db);
+        _tree_encode(n, right_from, n->count, n->leaf ? 0 : n->e[m].ref, buf);
+        if (n->leaf) {
+            ((struct TreeHeader*)buf)->next = n->next;
+            ((struct TreeHeader*)buf)->prev = off;
+            if (n->next)
+                pager_write(db, n->next + offsetof(struct TreeHeader, prev), &right, sizeof(uint32_t));
+        }
+        pager_write(db, right, buf, BLOCK_SIZE);
+
+        _tree_encode(n, 0, m, n->child0, buf);
+        if (n->leaf) {
+            ((struct TreeHeader*)buf)->next = right;
+            ((struct TreeHeader*)buf)->prev = n->prev;
+        }
+        _tree_write_page(db, off, old, buf);
+        free(n->keys);
+
+        if (depth == 0) {
+            //the root split - the tree grows a level
+            uint32_t root = _tree_alloc_page(db);
+            n->leaf = false;
+            n->count = 1;
+            n->e[0].key = sep;
+            n->e[0].key_len = sep_len;
+            n->e[0].value = NULL;
+            n->e[0].ref = right;
+            _tree_encode(n, 0, 1, off, buf);
+            pager_write(db, root, buf, BLOCK_SIZE);
+            pager_write(db, TREE_ROOT_OFF, &root, sizeof(uint32_t));
+            return;
+        }
+
+        depth--;
+        off = path[depth];
+        uint32_t idx = path_idx[depth];
+        pager_read(db, off, old, BLOCK_SIZE);
+        _tree_decode(old, n);
+        memmove(&n->e[idx + 1], &n->e[idx], (n->count - idx) * sizeof(struct TreeEntry));
+        n->e[idx].key = sep;
+        n->e[idx].key_len = sep_len;
+        n->e[idx].value = NULL;
+        n->e[idx].ref = right;
+        n->count++;
+    }
+
+    _tree_encode(n, 0, n->count, n->child0, buf);
+    ((struct TreeHeader*)buf)->next = n->next;
+    ((struct TreeHeader*)buf)->prev = n->prev;
+    _tree_write_page(db, off, old, buf);
+    free(n->keys);
+}
+
+//rejected up front if the heap has no room for the value record and a new node at every level
+int tree_store(struct DB* db, const char* key, uint32_t key_len, const char* value, uint32_t value_len) {
+    if (key_len > TREE_KEY_MAX)
+        return -1;
+    uint64_t grow = (TREE_DEPTH_MAX + 2) * 2 * BLOCK_SIZE; //each new node may be padded to a block boundary
+    if (value_len > TREE_INLINE_MAX)
+        grow += REC_HEADER_SIZE + (uint64_t)value_len + HEAP_EXTENT;
+    if (!table_has_room(db, grow))
+        return -1;
+
+    char page[BLOCK_SIZE];
+    uint32_t path[TREE_DEPTH_MAX];
+    uint32_t path_idx[TREE_DEPTH_MAX];
+    uint32_t depth;
+    uint32_t off = _tree_find_leaf(db, key, key_len, page, path, path_idx, &depth);
+    if (!off) {
+        off = _tree_alloc_page(db);
+        memset(page, 0, BLOCK_SIZE);
+        ((struct TreeHeader*)page)->leaf = true;
+        ((struct TreeHeader*)page)->data_start = BLOCK_SIZE;
+        pager_write(db, off, page, BLOCK_SIZE);
+        pager_write(db, TREE_ROOT_OFF, &off, sizeof(uint32_t));
+    }
+
+    struct TreeEntry e;
+    e.key = key;
+    e.key_len = key_len;
+    e.value = value;
+    e.value_len = value_len;
+    e.ref = 0;
+    if (value_len > TREE_INLINE_MAX) {
+        e.value = NULL;
+        e.ref = _tree_put_value(db, value, value_len);
+    }
+
+    char old[BLOCK_SIZE];
+    memcpy(old, page, BLOCK_SIZE);
+    uint32_t idx = _tree_search(page, key, key_len, false);
+    if (idx < ((struct TreeHeader*)page)->count && _tree_cmp_slot(page, idx, key, key_len) == 0) {
+        struct TreeSlot s;
+        _tree_slot(page, idx, &s);
+        if (!s.value)
+            table_free_rec(db, s.ref);
+        _tree_remove_slot(page, idx);
+    }
+
+    if (_tree_leaf_insert(page, idx, &e)) {
+        _tree_write_page(db, off, old, page);
+        return 0;
+    }
+
+    //no room without compacting the node (or the prefix changed) - rewrite it, splitting if needed
+    struct TreeNode n;
+    _tree_decode(page, &n);
+    memmove(&n.e[idx + 1], &n.e[idx], (n.count - idx) * sizeof(struct TreeEntry));
+    n.e[idx] = e;
+    n.count++;
+
+    _tree_update(db, off, old, &n, path, path_idx, depth);
+    return 0;
+}
+
+//nodes are not merged when they empty out - an empty leaf just stays in the sibling chain
+int tree_delete(struct DB* db, const char* key, uint32_t key_len) {
+    char page[BLOCK_SIZE];
+    uint32_t off = _tree_find_leaf(db, key, key_len, page, NULL, NULL, NULL);
+    if (!off)
+        return -1;
+
+    uint32_t idx = _tree_search(page, key, key_len, false);
+    if (idx == ((struct TreeHeader*)page)->count || _tree_cmp_slot(page, idx, key, key_len) != 0)
+        return -1;
+
+    char old[BLOCK_SIZE];
+    memcpy(old, page, BLOCK_SIZE);
+    struct TreeSlot s;
+    _tree_slot(page, idx, &s);
+    if (!s.value)
+        table_free_rec(db, s.ref);
+    _tree_remove_slot(page, idx);
+
+    _tree_write_page(db, off, old, page);
+    return 0;
+}
+
+//finds where the value of 'key' is kept: in its leaf, or in the heap record it overflowed to
+bool tree_find(struct DB* db, const char* key, uint32_t key_len, uint64_t* value_off, uint32_t* value_len) {
+    char page[BLOCK_SIZE];
+    uint32_t off = _tree_find_leaf(db, key, key_len, page, NULL, NULL, NULL);
+    if (!off)
+        return false;
+
+    uint32_t idx = _tree_search(page, key, key_len, false);
+    if (idx == ((struct TreeHeader*)page)->count || _tree_cmp_slot(page, idx, key, key_len) != 0)
+        return false;
+
+    struct TreeSlot s;
+    _tree_slot(page, idx, &s);
+    *value_off = s.value ? off + (uint32_t)(s.value - page) : s.ref + table_read_rec(db, s.ref).header_len;
+    *value_len = s.value_len;
+    return true;
+}
+
+//returns the first key after 'after', or the first key if 'after' is NULL
+//seeking by key rather than keeping a position means splits between calls cannot skip or repeat keys
+char* tree_next_key(struct DB* db, const char* after) {
+    const char* key = after ? after : "";
+    uint32_t key_len = strlen(key);
+    char page[BLOCK_SIZE];
+    uint32_t off = _tree_find_leaf(db, key, key_len, page, NULL, NULL, NULL);
+    if (!off)
+        return NULL;
+
+    uint32_t slot = _tree_search(page, key, key_len, after != NULL);
+    if (!_tree_leaf_walk(db, &off, page, &slot))
+        return NULL;
+
+    char buf[TREE_KEY_MAX];
+    uint32_t len = _tree_slot_key(page, slot, buf);
+    char* ret = _malloc(len + 1);
+    memcpy(ret, buf, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+//calls 'cb' on every key from 'lo' (or after it, if 'after' is set) up to but not including 'hi', in order,
+//following the leaf sibling links and hinting each next leaf to the pager before the scan gets there
+//a NULL 'hi' is open; returns 1 if 'cb' stopped the scan by returning nonzero, 0 once it ran out of keys
+int tree_scan(struct DB* db, const char* lo, uint32_t lo_len, bool after, const char* hi, uint32_t hi_len,
+              TreeScanFn cb, void* arg) {
+    char page[BLOCK_SIZE];
+    uint32_t off = _tree_find_leaf(db, lo, lo_len, page, NULL, NULL, NULL);
+    if (!off)
+        return 0;
+
+    char key[TREE_KEY_MAX];
+    uint32_t prefetched = 0;
+    uint32_t slot = _tree_search(page, lo, lo_len, after);
+    while (_tree_leaf_walk(db, &off, page, &slot)) {
+        uint32_t next = ((struct TreeHeader*)page)->next;
+        if (next && next != prefetched) {
+            pager_prefetch(db, next, BLOCK_SIZE);
+            prefetched = next;
+        }
+        if (hi && _tree_cmp_slot(page, slot, hi, hi_len) <= 0)
+            break;
+
+        uint32_t len = _tree_slot_key(page, slot, key);
+        struct TreeSlot s;
+        _tree_slot(page, slot, &s);
+        char* data = NULL;
+        if (!s.value) {
+            data = _malloc(s.value_len);
+            pager_read(db, s.ref + table_read_rec(db, s.ref).header_len, data, s.value_len);
+        }
+        int stop = cb(key, len, s.value ? s.value : data, s.value_len, arg);
+        free(data);
+        if (stop)
+            return 1;
+        slot++;
+    }
+
+    return 0;
+}
+
+struct TreeRange {
+    const char* hi;
+    uint32_t hi_len;
+    DbRangeFn cb;
+    void* arg;
+};
+
+//hands one key of tree_range to its callback as C strings, stopping past 'hi'
+static int _tree_range_key(const char* key, uint32_t key_len, const char* value, uint32_t value_len, void* arg) {
+    struct TreeRange* r = arg;
+    if (r->hi && _tree_cmp(key, key_len, r->hi, r->hi_len) > 0)
+        return 1;
+
+    char key_buf[TREE_KEY_MAX + 1];
+    char value_buf[TREE_INLINE_MAX + 1];
+    char* data = value_len > TREE_INLINE_MAX ? _malloc(value_len + 1) : value_buf;
+    memcpy(key_buf, key, key_len);
+    key_buf[key_len] = '\0';
+    memcpy(data, value, value_len);
+    data[value_len] = '\0';
+    int stop = r->cb(key_buf, data, r->arg);
+    if (data != value_buf)
+        free(data);
+    return stop;
+}
+
+//calls 'cb' on every key in [lo, hi] in order
+//NULL bounds are open, and a nonzero return from 'cb' stops the scan
+int tree_range(struct DB* db, const char* lo, const char* hi, DbRangeFn cb, void* arg) {
+    const char* start = lo ? lo : "";
+    struct TreeRange r = { hi, hi ? strlen(hi) : 0, cb, arg };
+    tree_scan(db, start, strlen(start), false, NULL, 0, _tree_range_key, &r);
+    return 0;
+}
+
+//bounds of partition 'part' of 'parts' of the key space, cut at separators in the root so that each
+//partition covers about as many of its subtrees: [lo, hi), with 'hi_len' set to UINT32_MAX if hi is open
+//the bounds stay valid as the tree changes, so partitions never overlap and together always cover every key
+//returns false for an empty partition, when there are more partitions than subtrees
+bool tree_partition(struct DB* db, uint32_t part, uint32_t parts, char* lo, uint32_t* lo_len, char* hi, uint32_t* hi_len) {
+    char page[BLOCK_SIZE];
+    uint32_t off;
+    uint32_t children = 1;
+    pager_read(db, TREE_ROOT_OFF, &off, sizeof(uint32_t));
+    if (off) {
+        pager_read(db, off, page, BLOCK_SIZE);
+        if (!((struct TreeHeader*)page)->leaf)
+            children = ((struct TreeHeader*)page)->count + 1;
+    }
+
+    //separator i is the lowest key of child i + 1
+    uint32_t first = (uint64_t)part * children / parts;
+    uint32_t end = (uint64_t)(part + 1) * children / parts;
+    if (first == end)
+        return false;
+
+    *lo_len = first ? _tree_slot_key(page, first - 1, lo) : 0;
+    *hi_len = end < children ? _tree_slot_key(page, end - 1, hi) : UINT32_MAX;
+    return true;
+}
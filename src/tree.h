@@ -0,0 +1,43 @@
+#ifndef UDB_TREE_H
+#define UDB_TREE_H
+
+#include "urchin.h"
+#include "pager.h"
+
+#define TREE_KEY_MAX 512
+#define TREE_INLINE_MAX 512 //larger values are kept in a heap record outside the leaf
+#define TREE_DEPTH_MAX 16
+#define TREE_ENTRIES_MAX (BLOCK_SIZE / 8) //smallest entry is an empty key with its slot
+
+//every node is one block:
+//header, the prefix shared by all keys in the node, a slot array of entry offsets in key order,
+//and the entries themselves packed from the end of the block
+//leaf entry: suffix length (uint16_t), overflow flag (uint8_t), value length (uint32_t), suffix, value
+//or the offset of the heap record holding it
+//internal entry: suffix length (uint16_t), child (uint32_t), suffix - keys >= the separator are in 'child',
+//keys below the first separator are in 'child0'
+struct TreeHeader {
+    uint8_t leaf;
+    uint8_t unused;
+    uint16_t count;
+    uint16_t prefix_len;
+    uint16_t data_start;
+    uint32_t next; //leaf siblings
+    uint32_t prev;
+    uint32_t child0;
+};
+
+//called by tree_scan for each key in order, returning nonzero stops the scan
+//the key and value are only valid during the call
+typedef int (*TreeScanFn)(const char* key, uint32_t key_len, const char* value, uint32_t value_len, void* arg);
+
+int tree_store(struct DB* db, const char* key, uint32_t key_len, const char* value, uint32_t value_len);
+int tree_delete(struct DB* db, const char* key, uint32_t key_len);
+bool tree_find(struct DB* db, const char* key, uint32_t key_len, uint64_t* value_off, uint32_t* value_len);
+char* tree_next_key(struct DB* db, const char* after);
+int tree_scan(struct DB* db, const char* lo, uint32_t lo_len, bool after, const char* hi, uint32_t hi_len,
+              TreeScanFn cb, void* arg);
+int tree_range(struct DB* db, const char* lo, const char* hi, DbRangeFn cb, void* arg);
+bool tree_partition(struct DB* db, uint32_t part, uint32_t parts, char* lo, uint32_t* lo_len, char* hi, uint32_t* hi_len);
+
+#endif //UDB_TREE_H
@@ -7,37 +7,116 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "urchin.h"
 #include "util.h"
 #include "pager.h"
 #include "table.h"
+#include "wal.h"
+#include "tree.h"
+#include "lock.h"
+#include "shared.h"
+#include "checkpoint.h"
 
+//where db_nextrec is in a scan, one per thread
+struct DbScan {
+    uint32_t bucket;
+    uint32_t rec_off;
+    char* key; //last key returned (tree engine)
+    struct DbScan* next;
+};
+
+#define CURSOR_BATCH (64 * 1024) //bytes of keys and values a cursor reads ahead at a time
+#define CURSOR_PREFETCH 8 //chains past the batch whose first blocks are hinted to the pager
+
+//records are read ahead into 'batch' a whole hash chain (or a run of tree keys) at a time, under one read lock,
+//as key length, value length (uint32_t each), key and value
+//a hash partition is the buckets whose index is in [res_start, res_end) modulo BUCKETS_INIT - a split moves
+//records between buckets that agree there, so no record ever leaves its partition
+//a tree partition is a key range, see tree_partition, and the scan continues after the last key read
+struct DbCursor {
+    struct DB* db;
+    char* batch;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t pos;
+    bool done;
+    uint32_t bucket;
+    uint32_t res_start;
+    uint32_t res_end;
+    char last[TREE_KEY_MAX];
+    uint32_t last_len;
+    bool started;
+    char hi[TREE_KEY_MAX];
+    uint32_t hi_len;
+};
+
+//fetches are served by a thread of the queue's own, which takes every fetch submitted since its last round
+//and looks them up together like db_multi_get, so the blocks they miss are read in one batch (through io_uring
+//with DBOptions.async_io) while the callers go on; 'outstanding' counts fetches submitted and not yet reaped
+struct DbFetchQueue {
+    struct DB* db;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted_cond;
+    pthread_cond_t done_cond;
+    bool stop;
+    uint32_t depth;
+    uint32_t outstanding;
+    struct DbFetch* submitted; //oldest first, as are the other lists
+    struct DbFetch* submitted_tail;
+    struct DbFetch* done;
+    struct DbFetch* done_tail;
+    struct DbFetch** batch;
+};
 
-static FILE* _db_open(const char* filename, bool fill) {
-    FILE* f;
-    if (!(f = fopen(filename, "r+"))) {
-        f = _fopen(filename, "w");
-        if (fill) {
-            void* ptr;
-            ptr = _calloc(RECORD_OFF, sizeof(uint8_t));
-            _write_lock(f, SEEK_SET, 0, 0);
-            _fwrite(ptr, sizeof(uint8_t), RECORD_OFF, f);
-            _unlock(f, SEEK_SET, 0, 0);
-            free(ptr);
-        }
 
-        fclose(f);
+//returns with the index file write-locked so the log can be set up before anyone else uses it
+//creates the index file with an empty freelist and hash table if it does not exist yet,
+//in which case 'fresh' is set and any log left over from an earlier file with the same name is discarded
+//files written before the super block had a header get one, with the heap ending at the end of the file
+//and the rest of the super block (hash state) cleared
+//the storage engine is recorded in the super block when the file is created
+//a new hash table file starts with the directory entries of its first buckets right after the chain heads,
+//which it leaves unused
+static int _db_open(const char* filename, bool* fresh, enum DbEngine* engine) {
+    int fd = _open(filename, O_RDWR | O_CREAT);
+    _write_lock(fd, SEEK_SET, 0, LOCK_SNAPSHOT_OFF);
 
-        f = _fopen(filename, "r+");
+    uint64_t size = _file_size(fd);
+    uint32_t header[SUPER_SIZE / sizeof(uint32_t)] = {0};
+    *fresh = size == 0;
+    if (*fresh) {
+        size = *engine == DB_ENGINE_HASH ? DIR_INIT_OFF + DIR_INIT_SIZE : RECORD_OFF;
+        void* ptr;
+        ptr = _calloc(size, sizeof(uint8_t));
+        _pwrite(fd, ptr, size, 0);
+        free(ptr);
+    } else {
+        _pread(fd, header, sizeof(uint32_t) * 3, SUPER_OFF);
     }
 
-    setbuf(f, NULL);
+    if (*fresh || header[0] != SUPER_MAGIC) {
+        header[0] = SUPER_MAGIC;
+        header[1] = *fresh ? SUPER_VERSION : SUPER_VERSION_LEGACY;
+        header[2] = size;
+        header[ENGINE_OFF / sizeof(uint32_t)] = *fresh ? *engine : DB_ENGINE_HASH;
+        if (*fresh && *engine == DB_ENGINE_HASH) {
+            header[DIR_OFF / sizeof(uint32_t)] = 1; //valid
+            header[DIR_OFF / sizeof(uint32_t) + 1] = DIR_INIT_OFF; //segment 0
+        }
+        _pwrite(fd, header, SUPER_SIZE, SUPER_OFF);
+    } else {
+        uint32_t stored;
+        _pread(fd, &stored, sizeof(uint32_t), ENGINE_OFF);
+        *engine = stored;
+    }
 
-    return f;
+    return fd;
 }
 
-struct DB* db_open(const char* dbname) {
+struct DB* db_open(const char* dbname, const struct DBOptions* opts) {
     struct DB* db;
     db = _calloc(1, sizeof(struct DB));
 
@@ -48,108 +127,932 @@ struct DB* db_open(const char* dbname) {
 
     memcpy(filename + len, ".idx", 4);
     filename[len + 4] = 0;
-    db->idxf = _db_open(filename, true);
-    _fseek(db->idxf, 0, SEEK_END);
+    bool fresh;
+    db->engine = opts ? opts->engine : DB_ENGINE_HASH;
+    db->idxfd = _db_open(filename, &fresh, &db->engine);
 
-    db->chain_off = FREELIST_OFF;
-    db->idxrec_off = 0;
+    lock_init(db);
+    pthread_key_create(&db->scan, NULL);
+    pthread_mutex_init(&db->scans_lock, NULL);
 
-    struct Block* blocks = _calloc(BLOCKS_MAX, sizeof(struct Block));
-    for (int i = 1; i < BLOCKS_MAX - 1; i++) {
-        blocks[i].next = &blocks[i + 1];
+    uint64_t cache_bytes = DB_CACHE_DEFAULT;
+    bool huge_pages = false;
+    enum DbCachePolicy policy = DB_CACHE_LRU;
+    enum DbIoMode io_mode = DB_IO_POOL;
+    bool async_io = false;
+    bool sync = true;
+    uint64_t shared_cache_bytes = 0;
+    uint32_t checkpoint_ms = 0;
+    uint64_t checkpoint_bytes_per_sec = 0;
+    if (opts) {
+        if (opts->cache_bytes)
+            cache_bytes = opts->cache_bytes;
+        huge_pages = opts->huge_pages;
+        policy = opts->cache_policy;
+        io_mode = opts->io_mode;
+        async_io = opts->async_io;
+        sync = !opts->no_sync;
+        shared_cache_bytes = opts->shared_cache_bytes;
+        checkpoint_ms = opts->checkpoint_ms;
+        checkpoint_bytes_per_sec = opts->checkpoint_bytes_per_sec;
     }
-    blocks[BLOCKS_MAX - 1].next = NULL;
-    db->blocks = &blocks[1];
-    db->super = blocks;
-    db->super->idx = 0;
+    pager_open(db, cache_bytes, huge_pages, policy, io_mode == DB_IO_MMAP, async_io);
+
+    memcpy(filename + len, ".wal", 4);
+    bool new_log = wal_open(db, filename, sync, fresh);
+    if (shared_cache_bytes)
+        shared_open(db, shared_cache_bytes, new_log);
+    _unlock(db->idxfd, SEEK_SET, 0, LOCK_SNAPSHOT_OFF);
+    if (checkpoint_ms)
+        checkpoint_start(db, checkpoint_ms, checkpoint_bytes_per_sec);
 
     return db;
 }
 
+//NOTE: no other thread should be using the handle
 void db_close(struct DB* db) {
-    fclose(db->idxf);
-    free(db->super); //remaining blocks in contiguous memory should be freed too (right???)
+    if (db->in_txn)
+        db_abort(db);
+    checkpoint_stop(db);
+    while (db->scans) {
+        struct DbScan* next = db->scans->next;
+        free(db->scans->key);
+        free(db->scans);
+        db->scans = next;
+    }
+    pthread_key_delete(db->scan);
+    pthread_mutex_destroy(&db->scans_lock);
+    shared_close(db);
+    close(db->idxfd);
+    pager_close(db);
+    wal_close(db);
+    lock_destroy(db);
+    free(db);
 }
 
+void db_set_cache_size(struct DB* db, uint64_t cache_bytes) {
+    pthread_rwlock_wrlock(&db->latch);
+    pthread_rwlock_wrlock(&db->snap_latch);
+    pager_resize(db, cache_bytes);
+    pthread_rwlock_unlock(&db->snap_latch);
+    pthread_rwlock_unlock(&db->latch);
+}
+
+//a transaction holds the handle for the thread that began it, other threads wait for it like any writer
+static bool _db_in_txn(struct DB* db) {
+    return __atomic_load_n(&db->in_txn, __ATOMIC_ACQUIRE) && pthread_equal(db->txn_owner, pthread_self());
+}
+
+//returns this thread's scan position, starting a scan at the beginning the first time
+static struct DbScan* _db_scan(struct DB* db) {
+    struct DbScan* s = pthread_getspecific(db->scan);
+    if (!s) {
+        s = _calloc(1, sizeof(struct DbScan));
+        pthread_mutex_lock(&db->scans_lock);
+        s->next = db->scans;
+        db->scans = s;
+        pthread_mutex_unlock(&db->scans_lock);
+        pthread_setspecific(db->scan, s);
+    }
+    return s;
+}
+
+static struct DbSlice _db_slice(const char* s) {
+    return (struct DbSlice){ s, strlen(s) };
+}
 
 //the table interface should be the same as that of the tree interface
-int db_store(struct DB* db, const char* key, const char* data) {
-    _write_lock(db->idxf, SEEK_SET, 0, 0);
-    table_read_metadata(db);
+//returns -1 without changing anything if the heap has no room left for the value
+static int _db_store(struct DB* db, struct DbSlice key, struct DbSlice value) {
+    if (db->engine == DB_ENGINE_BTREE)
+        return tree_store(db, key.data, key.len, value.data, value.len);
 
-    uint32_t rec_off;
-    if ((rec_off = table_find_rec(db, key)) == 0) { //record with given key does not exist
-        table_insert_rec(db, key, data);
-    } else { //record with given key exists
-        struct Record r = table_read_rec(db, rec_off);
-        if (strlen(data) <= r.data_len) {
-            r.data_len = strlen(data);
-            table_write_rec(db, rec_off, r, key, data);
-        } else {
-            table_delete_rec(db, key);
-            table_insert_rec(db, key, data);
+    struct Record r;
+    uint32_t rec_off = table_find_rec(db, key.data, key.len, &r);
+    if (rec_off && table_rec_fits(db, r, value.len)) {
+        r.data_len = value.len;
+        table_write_rec(db, rec_off, r, key.data, value.data);
+    } else {
+        //the new record goes in ahead of the old one, which is only taken out once the store cannot fail
+        if (table_insert_rec(db, key.data, key.len, value.data, value.len) != 0)
+            return -1;
+        if (rec_off)
+            table_delete_rec(db, key.data, key.len, rec_off);
+    }
+
+    if (db->lock_mode == DB_LOCK_EXCLUSIVE)
+        table_maintain(db);
+    return 0;
+}
+
+static int _db_delete(struct DB* db, struct DbSlice key) {
+    if (db->engine == DB_ENGINE_BTREE)
+        return tree_delete(db, key.data, key.len);
+
+    int res = table_delete_rec(db, key.data, key.len, 0);
+    if (db->lock_mode == DB_LOCK_EXCLUSIVE)
+        table_maintain(db);
+    return res;
+}
+
+//finds where the value of 'key' is kept, so it can be read in one go
+//NOTE: the read lock or the transaction should be held
+static bool _db_find(struct DB* db, struct DbSlice key, uint64_t* value_off, uint32_t* value_len) {
+    if (db->engine == DB_ENGINE_BTREE)
+        return tree_find(db, key.data, key.len, value_off, value_len);
+
+    struct Record r;
+    uint32_t rec_off = table_find_rec(db, key.data, key.len, &r);
+    if (!rec_off)
+        return false;
+
+    *value_off = table_value_off(db, rec_off, &r);
+    *value_len = r.data_len;
+    return true;
+}
+
+//values too large to be kept inline are read like a scan, so they are the first blocks evicted
+//and the cache is left to the index
+static bool _db_value_cold(struct DB* db, uint32_t value_len) {
+    return value_len > (db->engine == DB_ENGINE_BTREE ? TREE_INLINE_MAX : TABLE_INLINE_MAX);
+}
+
+//returns the thread's hint as it was, to be put back by _db_value_end once the value has been read,
+//so a value fetched in the middle of a scan leaves the scan's hint in place
+static enum PagerHint _db_value_begin(struct DB* db, uint32_t value_len) {
+    enum PagerHint prev = pager_hint(db, PAGER_HINT_SCAN);
+    if (!_db_value_cold(db, value_len))
+        pager_hint(db, prev);
+    return prev;
+}
+
+static void _db_value_end(struct DB* db, enum PagerHint prev) {
+    pager_hint(db, prev);
+}
+
+//a key of a batch, with its place in the batch and, for a hash table, its bucket
+struct DbKeyRef {
+    struct DbSlice key;
+    uint32_t bucket;
+    uint32_t i;
+};
+
+static int _db_key_cmp(const void* a, const void* b) {
+    const struct DbKeyRef* x = a;
+    const struct DbKeyRef* y = b;
+    int c = memcmp(x->key.data, y->key.data, x->key.len < y->key.len ? x->key.len : y->key.len);
+    if (!c && x->key.len != y->key.len)
+        c = x->key.len < y->key.len ? -1 : 1;
+    return c ? c : (x->i < y->i ? -1 : x->i > y->i);
+}
+
+static int _db_bucket_cmp(const void* a, const void* b) {
+    const struct DbKeyRef* x = a;
+    const struct DbKeyRef* y = b;
+    if (x->bucket != y->bucket)
+        return x->bucket < y->bucket ? -1 : 1;
+    return x->i < y->i ? -1 : x->i > y->i;
+}
+
+//the order a batch of keys is best visited in: by bucket for a hash table, by key for the tree,
+//so that keys sharing a chain or a leaf come one after another; keys given twice keep their order
+//the caller frees the result
+static struct DbKeyRef* _db_sort_keys(struct DB* db, const struct DbSlice* keys, uint32_t count) {
+    struct DbKeyRef* order = _malloc(count * sizeof(struct DbKeyRef));
+    for (uint32_t i = 0; i < count; i++) {
+        order[i].key = keys[i];
+        order[i].bucket = db->engine == DB_ENGINE_HASH ? table_key_bucket(db, keys[i].data, keys[i].len) : 0;
+        order[i].i = i;
+    }
+    qsort(order, count, sizeof(struct DbKeyRef), db->engine == DB_ENGINE_HASH ? _db_bucket_cmp : _db_key_cmp);
+    return order;
+}
+
+//_db_find for 'count' keys at once, value_offs[i] set to 0 if there is no such key as keys[i]
+static void _db_find_many(struct DB* db, const struct DbSlice* keys, uint32_t count, uint64_t* value_offs, uint32_t* value_lens) {
+    if (db->engine == DB_ENGINE_BTREE) {
+        struct DbKeyRef* order = _db_sort_keys(db, keys, count);
+        for (uint32_t j = 0; j < count; j++) {
+            uint32_t i = order[j].i;
+            if (!tree_find(db, keys[i].data, keys[i].len, &value_offs[i], &value_lens[i]))
+                value_offs[i] = 0;
+        }
+        free(order);
+        return;
+    }
+
+    uint32_t* rec_offs = _malloc(count * sizeof(uint32_t));
+    struct Record* recs = _malloc(count * sizeof(struct Record));
+    table_find_many(db, keys, count, rec_offs, recs);
+    //the records of keys that were not found are left unset
+    for (uint32_t i = 0; i < count; i++) {
+        value_offs[i] = 0;
+        if (rec_offs[i]) {
+            value_offs[i] = table_value_off(db, rec_offs[i], &recs[i]);
+            value_lens[i] = recs[i].data_len;
         }
     }
+    free(rec_offs);
+    free(recs);
+}
+
+//hash table writers share the file with each other, holding only the lock of the key's bucket
+//the B+tree has no such partitioning and is written with the whole file locked
+static void _db_lock_key(struct DB* db, struct DbSlice key) {
+    if (db->engine == DB_ENGINE_BTREE) {
+        lock_exclusive(db);
+        return;
+    }
+
+    lock_shared(db);
+    lock_bucket(db, table_key_bucket(db, key.data, key.len));
+}
+
+//checked by a write before it lets go of its locks
+static bool _db_maintenance_due(struct DB* db) {
+    return db->engine == DB_ENGINE_HASH && (table_maintenance_due(db) || wal_size(db) > db->pager->checkpoint_size);
+}
+
+//splits, compaction steps and checkpoints move things other writers rely on,
+//so they are made after a write has let go of its bucket, with the whole file locked
+//another thread or process may have done the work in between, so it is checked again
+static void _db_maintain(struct DB* db) {
+    lock_exclusive(db);
+    if (_db_maintenance_due(db)) {
+        table_maintain(db);
+        table_commit(db);
+    }
+    lock_release(db);
+    wal_sync(db);
+}
+
+//inside a transaction the write lock is already held and the metadata already read
+int db_put(struct DB* db, struct DbSlice key, struct DbSlice value) {
+    if (_db_in_txn(db))
+        return _db_store(db, key, value);
+
+    _db_lock_key(db, key);
+
+    int res = _db_store(db, key, value);
 
     table_commit(db);
-    _unlock(db->idxf, SEEK_SET, 0, 0);
-    return 0;
+    bool due = _db_maintenance_due(db);
+    lock_release(db);
+    wal_sync(db);
+    if (due)
+        _db_maintain(db);
+    return res;
+}
+
+//returns -1 if there was no such key
+int db_del(struct DB* db, struct DbSlice key) {
+    if (_db_in_txn(db))
+        return _db_delete(db, key);
+
+    _db_lock_key(db, key);
+
+    int res = _db_delete(db, key);
+
+    table_commit(db);
+    bool due = _db_maintenance_due(db);
+    lock_release(db);
+    wal_sync(db);
+    if (due)
+        _db_maintain(db);
+    return res;
+}
+
+int db_store(struct DB* db, const char* key, const char* data) {
+    return db_put(db, _db_slice(key), _db_slice(data));
 }
 
 void db_delete(struct DB* db, const char* key) {
-    _write_lock(db->idxf, SEEK_SET, 0, 0);
-    table_read_metadata(db);
+    db_del(db, _db_slice(key));
+}
+
+//takes the write lock and reads the metadata once for every store and delete until db_commit or db_abort
+//returns -1 if a transaction is already open
+int db_begin(struct DB* db) {
+    if (_db_in_txn(db))
+        return -1;
+
+    lock_exclusive(db);
+    db->txn_owner = pthread_self();
+    __atomic_store_n(&db->in_txn, true, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    int res = table_delete_rec(db, key);
+//all changes since db_begin become one log frame, made durable with one sync
+int db_commit(struct DB* db) {
+    if (!_db_in_txn(db))
+        return -1;
 
     table_commit(db);
-    _unlock(db->idxf, SEEK_SET, 0, 0);
+    __atomic_store_n(&db->in_txn, false, __ATOMIC_RELEASE);
+    lock_release(db);
+    wal_sync(db);
+    return 0;
+}
+
+int db_abort(struct DB* db) {
+    if (!_db_in_txn(db))
+        return -1;
+
+    table_abort(db);
+    __atomic_store_n(&db->in_txn, false, __ATOMIC_RELEASE);
+    lock_release(db);
+    return 0;
+}
+
+//stores 'count' keys under one lock and in one log frame, as a transaction of its own or as part of the caller's
+//the chains of the keys are first loaded together in file order, then the keys are stored in bucket order
+//(key order for the tree), so the writes go over the file once; a key given twice ends up with its later value
+//nothing is stored if a store is rejected, unless the caller has a transaction open, which is then up to it
+int db_multi_put(struct DB* db, const struct DbSlice* keys, const struct DbSlice* values, uint32_t count) {
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        db_begin(db);
+
+    if (db->engine == DB_ENGINE_HASH) {
+        uint32_t* rec_offs = _malloc(count * sizeof(uint32_t));
+        struct Record* recs = _malloc(count * sizeof(struct Record));
+        table_find_many(db, keys, count, rec_offs, recs);
+        free(rec_offs);
+        free(recs);
+    }
+
+    struct DbKeyRef* order = _db_sort_keys(db, keys, count);
+    int res = 0;
+    for (uint32_t j = 0; j < count && res == 0; j++) {
+        res = _db_store(db, keys[order[j].i], values[order[j].i]);
+    }
+    free(order);
+
+    if (in_txn)
+        return res;
+    if (res != 0) {
+        db_abort(db);
+        return -1;
+    }
+    return db_commit(db);
 }
 
+//applies 'count' stores and deletes atomically, as a single transaction
+//nothing is applied if a store is rejected
+int db_write_batch(struct DB* db, const struct DbWriteOp* ops, uint32_t count) {
+    if (db_begin(db) != 0)
+        return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (ops[i].type == DB_WRITE_STORE) {
+            if (_db_store(db, _db_slice(ops[i].key), _db_slice(ops[i].value)) != 0) {
+                db_abort(db);
+                return -1;
+            }
+        } else {
+            _db_delete(db, _db_slice(ops[i].key));
+        }
+    }
+
+    return db_commit(db);
+}
+
+//threads fetching through the same handle run in parallel
+//the caller frees the value
 char* db_fetch(struct DB* db, const char* key) {
-    _read_lock(db->idxf, SEEK_SET, 0, 0);
-    table_read_metadata(db);
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
 
-    uint32_t rec_off;
+    uint64_t off;
+    uint32_t len;
     char* data = NULL;
-    if ((rec_off = table_find_rec(db, key)) != 0) {
-        uint32_t key_size;
-        uint32_t data_size;
-        pager_read(db, rec_off + sizeof(uint32_t) , &key_size, sizeof(uint32_t));
-        pager_read(db, rec_off + sizeof(uint32_t) * 2, &data_size, sizeof(uint32_t));
-
-        data = _malloc(data_size + 1); //+1 for null terminator
-        pager_read(db, rec_off + sizeof(uint32_t) * 3 + key_size, data, data_size);
-        data[data_size] = '\0';
+    if (_db_find(db, _db_slice(key), &off, &len)) {
+        data = _malloc(len + 1); //+1 for null terminator
+        enum PagerHint hint = _db_value_begin(db, len);
+        pager_read(db, off, data, len);
+        _db_value_end(db, hint);
+        data[len] = '\0';
     }
 
-    _unlock(db->idxf, SEEK_SET, 0, 0);
+    if (!in_txn)
+        unlock_read(db);
     return data;
 }
 
+//copies the value of 'key' into 'buf' without allocating anything, returning -1 if there is no such key
+//'value_len' is set to the whole length of the value, of which only the first 'buf_len' bytes are copied
+int db_get_into(struct DB* db, struct DbSlice key, char* buf, uint32_t buf_len, uint32_t* value_len) {
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
+
+    uint64_t off;
+    uint32_t len;
+    bool found = _db_find(db, key, &off, &len);
+    if (found) {
+        enum PagerHint hint = _db_value_begin(db, len);
+        pager_read(db, off, buf, len < buf_len ? len : buf_len);
+        _db_value_end(db, hint);
+        *value_len = len;
+    }
+
+    if (!in_txn)
+        unlock_read(db);
+    return found ? 0 : -1;
+}
+
+//points 'view' at the value of 'key' in the handle's cache instead of copying it, returning -1 if there is no such key
+//the value stays as it was read until db_view_release, even if the key is changed or deleted in the meantime;
+//one the cache cannot hand out in place (split between blocks, or changed since the read began) is copied
+//each view pins a cache frame, so a thread should only hold a few, and all are released before db_set_cache_size or db_close
+int db_get_view(struct DB* db, struct DbSlice key, struct DbView* view) {
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
+
+    uint64_t off;
+    uint32_t len;
+    bool found = _db_find(db, key, &off, &len);
+    if (found) {
+        enum PagerHint hint = _db_value_begin(db, len);
+        view->len = len;
+        view->frame = NULL;
+        view->copy = NULL;
+        if (!(view->data = pager_view(db, off, len, &view->frame))) {
+            view->copy = _malloc(len + 1);
+            pager_read(db, off, view->copy, len);
+            view->data = view->copy;
+        }
+        _db_value_end(db, hint);
+    }
+
+    if (!in_txn)
+        unlock_read(db);
+    return found ? 0 : -1;
+}
+
+void db_view_release(struct DB* db, struct DbView* view) {
+    if (view->frame)
+        pager_view_release(db, view->frame);
+    free(view->copy);
+    view->data = NULL;
+    view->frame = NULL;
+    view->copy = NULL;
+}
+
+//copies the values of a run of keys (ranges tagged with the key's place in 'values') in file order
+static void _db_read_ranges(struct DB* db, struct PagerRange* ranges, uint32_t count, const struct DbSlice* values) {
+    pager_sort_ranges(ranges, count);
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t loaded = done + pager_load(db, ranges + done, count - done);
+        for (; done < loaded; done++) {
+            pager_read(db, ranges[done].off, (char*)values[ranges[done].tag].data, ranges[done].len);
+        }
+    }
+}
+
+//reads the value of every key _db_find_many found to where values[i].data points, skipping those with NULL data
+static void _db_read_values(struct DB* db, const uint64_t* offs, const uint32_t* lens, uint32_t count, const struct DbSlice* values) {
+    //inline values go at the front of 'ranges', the large ones at the back, to be read like a scan
+    struct PagerRange* ranges = _malloc(count * sizeof(struct PagerRange));
+    uint32_t small = 0;
+    uint32_t large = count;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!offs[i] || !values[i].data)
+            continue;
+        struct PagerRange r = { offs[i], lens[i], i };
+        if (_db_value_cold(db, lens[i]))
+            ranges[--large] = r;
+        else
+            ranges[small++] = r;
+    }
+
+    _db_read_ranges(db, ranges, small, values);
+    if (large < count) {
+        enum PagerHint hint = pager_hint(db, PAGER_HINT_SCAN);
+        _db_read_ranges(db, ranges + large, count - large, values);
+        pager_hint(db, hint);
+    }
+    free(ranges);
+}
+
+//looks up 'count' keys under one read lock, copying their values one after another into 'buf'
+//values[i] is set to where the value of keys[i] was copied, or has NULL data if there is no such key (and length 0)
+//or if the value did not fit in what was left of 'buf' (and its whole length, so it can be fetched on its own)
+//the chains (or leaves) and then the values are read in file order, the blocks missing from the cache read together
+//a run at a time, instead of in a round trip per key
+//returns the number of keys found
+int db_multi_get(struct DB* db, const struct DbSlice* keys, uint32_t count, char* buf, uint32_t buf_len, struct DbSlice* values) {
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
+
+    uint64_t* offs = _malloc(count * sizeof(uint64_t));
+    uint32_t* lens = _malloc(count * sizeof(uint32_t));
+    _db_find_many(db, keys, count, offs, lens);
+
+    uint64_t pos = 0;
+    int found = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        values[i].data = NULL;
+        values[i].len = 0;
+        if (!offs[i])
+            continue;
+
+        found++;
+        values[i].len = lens[i];
+        if (pos + lens[i] > buf_len)
+            continue;
+        values[i].data = buf + pos;
+        pos += lens[i];
+    }
+    _db_read_values(db, offs, lens, count, values);
+
+    free(offs);
+    free(lens);
+    if (!in_txn)
+        unlock_read(db);
+    return found;
+}
+
+//serves a round of fetches under one read lock, see struct DbFetchQueue
+static void _fetch_serve(struct DB* db, struct DbFetch** fetches, uint32_t count) {
+    struct DbSlice* keys = _malloc(count * sizeof(struct DbSlice));
+    struct DbSlice* values = _malloc(count * sizeof(struct DbSlice));
+    uint64_t* offs = _malloc(count * sizeof(uint64_t));
+    uint32_t* lens = _malloc(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i] = fetches[i]->key;
+    }
+
+    lock_read(db);
+    _db_find_many(db, keys, count, offs, lens);
+    for (uint32_t i = 0; i < count; i++) {
+        fetches[i]->value = NULL;
+        fetches[i]->len = 0;
+        values[i].data = NULL;
+        if (!offs[i])
+            continue;
+        fetches[i]->value = _malloc(lens[i] + 1); //+1 for null terminator
+        fetches[i]->value[lens[i]] = '\0';
+        fetches[i]->len = lens[i];
+        values[i].data = fetches[i]->value;
+    }
+    _db_read_values(db, offs, lens, count, values);
+    unlock_read(db);
+
+    free(keys);
+    free(values);
+    free(offs);
+    free(lens);
+}
+
+static void* _fetch_run(void* arg) {
+    struct DbFetchQueue* q = arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->submitted && !q->stop) {
+            pthread_cond_wait(&q->submitted_cond, &q->lock);
+        }
+        if (!q->submitted)
+            break;
+
+        uint32_t count = 0;
+        for (struct DbFetch* f = q->submitted; f; f = f->next) {
+            q->batch[count++] = f;
+        }
+        q->submitted = q->submitted_tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        _fetch_serve(q->db, q->batch, count);
+
+        pthread_mutex_lock(&q->lock);
+        for (uint32_t i = 0; i < count; i++) {
+            q->batch[i]->next = NULL;
+            if (q->done_tail)
+                q->done_tail->next = q->batch[i];
+            else
+                q->done = q->batch[i];
+            q->done_tail = q->batch[i];
+        }
+        pthread_cond_broadcast(&q->done_cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+//opens a queue for up to 'depth' fetches at a time, see struct DbFetchQueue
+//any number of queues can be open on a handle, each used by one thread at a time
+struct DbFetchQueue* db_fetch_queue_open(struct DB* db, uint32_t depth) {
+    if (!depth)
+        return NULL;
+
+    struct DbFetchQueue* q = _calloc(1, sizeof(struct DbFetchQueue));
+    q->db = db;
+    q->depth = depth;
+    q->batch = _malloc(depth * sizeof(struct DbFetch*));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->submitted_cond, NULL);
+    pthread_cond_init(&q->done_cond, NULL);
+    if (pthread_create(&q->thread, NULL, _fetch_run, q))
+        err_quit("pthread_create failed");
+    return q;
+}
+
+//starts fetching f->key, returning -1 if 'depth' fetches are already outstanding
+//the fetch is the caller's, and must stay put (with its key) until db_fetch_reap hands it back
+//the fetch is served by another thread, so it waits for a transaction open on the handle to end
+int db_fetch_submit(struct DbFetchQueue* q, struct DbFetch* f) {
+    pthread_mutex_lock(&q->lock);
+    if (q->outstanding == q->depth) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    q->outstanding++;
+    f->next = NULL;
+    if (q->submitted_tail)
+        q->submitted_tail->next = f;
+    else
+        q->submitted = f;
+    q->submitted_tail = f;
+    pthread_cond_signal(&q->submitted_cond);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+//hands back up to 'max' completed fetches in 'done', in the order they completed, and returns how many
+//f->value is then the value (null terminated, freed by the caller), or NULL if there was no such key
+//with 'wait' set, waits for a fetch to complete if none has but some are outstanding
+uint32_t db_fetch_reap(struct DbFetchQueue* q, struct DbFetch** done, uint32_t max, bool wait) {
+    pthread_mutex_lock(&q->lock);
+    while (wait && !q->done && q->outstanding) {
+        pthread_cond_wait(&q->done_cond, &q->lock);
+    }
+
+    uint32_t count = 0;
+    while (count < max && q->done) {
+        done[count++] = q->done;
+        q->done = q->done->next;
+    }
+    if (!q->done)
+        q->done_tail = NULL;
+    q->outstanding -= count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+//waits for the fetches still being served; those never reaped are complete, with their values the caller's to free
+void db_fetch_queue_close(struct DbFetchQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_signal(&q->submitted_cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->submitted_cond);
+    pthread_cond_destroy(&q->done_cond);
+    free(q->batch);
+    free(q);
+}
+
+//restarts this thread's scan
 void db_rewind(struct DB* db) {
-    db->chain_off = FREELIST_OFF;
-    db->idxrec_off = 0;
+    struct DbScan* s = _db_scan(db);
+    s->bucket = 0;
+    s->rec_off = 0;
+    free(s->key);
+    s->key = NULL;
 }
 
+//each call takes the read lock and catches up with other writers, like db_fetch
+//records moved by a bucket split between calls can be returned twice or skipped
+//every thread scans on its own, from where its last db_nextrec left off
 char* db_nextrec(struct DB* db) {
-    if (!db->idxrec_off) {
-        while (!db->idxrec_off && db->chain_off < RECORD_OFF) {
-            db->chain_off += sizeof(uint32_t);
-            pager_read(db, db->chain_off, &db->idxrec_off, sizeof(uint32_t));
+    struct DbScan* s = _db_scan(db);
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
+    enum PagerHint hint = pager_hint(db, PAGER_HINT_SCAN);
+
+    char* key = NULL;
+    if (db->engine == DB_ENGINE_BTREE) {
+        //the tree returns keys in order, continuing from the last one returned
+        key = tree_next_key(db, s->key);
+        if (key) {
+            free(s->key);
+            s->key = _malloc(strlen(key) + 1);
+            strcpy(s->key, key);
         }
+        pager_hint(db, hint);
+        if (!in_txn)
+            unlock_read(db);
+        return key;
     }
 
-    if (db->chain_off >= RECORD_OFF)
-        return NULL;
+    uint32_t bucket_count = table_bucket_count(db);
+    while (!s->rec_off && s->bucket < bucket_count) {
+        s->rec_off = table_bucket_head(db, s->bucket++);
+    }
 
-    struct Record r = table_read_rec(db, db->idxrec_off);
+    if (s->rec_off) {
+        struct Record r = table_read_rec(db, s->rec_off);
 
-    char* key = _malloc(r.key_len + 1);
-    pager_read(db, db->idxrec_off + KEY_OFF, key, r.key_len);
-    key[r.key_len] = '\0';
-    db->idxrec_off = r.next_off;
+        key = _malloc(r.key_len + 1);
+        pager_read(db, s->rec_off + r.header_len, key, r.key_len);
+        key[r.key_len] = '\0';
+        s->rec_off = r.next_off;
+    }
 
+    pager_hint(db, hint);
+    if (!in_txn)
+        unlock_read(db);
     return key;
 }
 
+//calls 'cb' on every key between 'lo' and 'hi' (inclusive, NULL for no bound) in key order
+//only the tree engine keeps keys ordered, returns -1 for a hash table
+int db_range(struct DB* db, const char* lo, const char* hi, DbRangeFn cb, void* arg) {
+    if (db->engine != DB_ENGINE_BTREE)
+        return -1;
+
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
+    enum PagerHint hint = pager_hint(db, PAGER_HINT_SCAN);
+
+    int res = tree_range(db, lo, hi, cb, arg);
+
+    pager_hint(db, hint);
+    if (!in_txn)
+        unlock_read(db);
+    return res;
+}
+
+//a cursor over partition 'part' of 'parts' (0 and 1 for the whole database), for one thread of a parallel scan
+//partitions never overlap and together hold every record; one can be empty if there are very many of them
+//each batch is read with the read lock held, like a db_fetch, and no lock is held between batches -
+//records moved by a bucket split between batches can be returned twice, tree keys are returned once
+struct DbCursor* db_cursor_open(struct DB* db, uint32_t part, uint32_t parts) {
+    if (part >= parts)
+        return NULL;
+
+    struct DbCursor* c = _calloc(1, sizeof(struct DbCursor));
+    c->db = db;
+    if (db->engine == DB_ENGINE_BTREE) {
+        bool in_txn = _db_in_txn(db);
+        if (!in_txn)
+            lock_read(db);
+        c->done = !tree_partition(db, part, parts, c->last, &c->last_len, c->hi, &c->hi_len);
+        if (!in_txn)
+            unlock_read(db);
+    } else {
+        c->res_start = (uint64_t)part * BUCKETS_INIT / parts;
+        c->res_end = (uint64_t)(part + 1) * BUCKETS_INIT / parts;
+        c->bucket = c->res_start;
+        c->done = c->res_start == c->res_end;
+    }
+    return c;
+}
+
+//the next bucket of the cursor's partition after 'bucket'
+static uint32_t _cursor_next_bucket(struct DbCursor* c, uint32_t bucket) {
+    bucket++;
+    uint32_t res = bucket % BUCKETS_INIT;
+    if (res < c->res_start)
+        return bucket + c->res_start - res;
+    if (res >= c->res_end)
+        return bucket + BUCKETS_INIT - res + c->res_start;
+    return bucket;
+}
+
+//makes room for a key and value at the end of the batch and returns where the key goes
+static char* _cursor_append(struct DbCursor* c, uint32_t key_len, uint32_t value_len) {
+    uint32_t len = sizeof(uint32_t) * 2 + key_len + value_len;
+    if (c->len + len > c->cap) {
+        while (c->len + len > c->cap) {
+            c->cap = c->cap ? c->cap * 2 : CURSOR_BATCH;
+        }
+        if (!(c->batch = realloc(c->batch, c->cap)))
+            err_quit("realloc failed");
+    }
+
+    char* ent = c->batch + c->len;
+    memcpy(ent, &key_len, sizeof(uint32_t));
+    memcpy(ent + sizeof(uint32_t), &value_len, sizeof(uint32_t));
+    c->len += len;
+    return ent + sizeof(uint32_t) * 2;
+}
+
+//reads whole chains until the batch is full, then hints the first blocks of the next few chains,
+//so they are on their way while the batch is used
+static void _cursor_fill_table(struct DbCursor* c) {
+    struct DB* db = c->db;
+    uint32_t bucket_count = table_bucket_count(db);
+    while (c->len < CURSOR_BATCH && c->bucket < bucket_count) {
+        uint32_t rec_off = table_bucket_head(db, c->bucket);
+        while (rec_off) {
+            struct Record r = table_read_rec(db, rec_off);
+            //the key and data follow the header, so both come with one read unless the data is in a value record
+            char* key = _cursor_append(c, r.key_len, r.data_len);
+            if (r.value_off) {
+                pager_read(db, rec_off + r.header_len, key, r.key_len);
+                pager_read(db, table_value_off(db, rec_off, &r), key + r.key_len, r.data_len);
+            } else {
+                pager_read(db, rec_off + r.header_len, key, r.key_len + r.data_len);
+            }
+            rec_off = r.next_off;
+        }
+        c->bucket = _cursor_next_bucket(c, c->bucket);
+    }
+    c->done = c->bucket >= bucket_count;
+
+    uint32_t bucket = c->bucket;
+    for (uint32_t i = 0; i < CURSOR_PREFETCH && bucket < bucket_count; i++) {
+        uint32_t head = table_bucket_head(db, bucket);
+        if (head)
+            pager_prefetch(db, head, REC_HEADER_SIZE);
+        bucket = _cursor_next_bucket(c, bucket);
+    }
+}
+
+static int _cursor_add_key(const char* key, uint32_t key_len, const char* value, uint32_t value_len, void* arg) {
+    struct DbCursor* c = arg;
+    char* ent = _cursor_append(c, key_len, value_len);
+    memcpy(ent, key, key_len);
+    memcpy(ent + key_len, value, value_len);
+    memcpy(c->last, key, key_len);
+    c->last_len = key_len;
+    c->started = true;
+    return c->len >= CURSOR_BATCH;
+}
+
+static void _cursor_fill(struct DbCursor* c) {
+    struct DB* db = c->db;
+    c->len = 0;
+    c->pos = 0;
+
+    bool in_txn = _db_in_txn(db);
+    if (!in_txn)
+        lock_read(db);
+    enum PagerHint hint = pager_hint(db, PAGER_HINT_SCAN);
+
+    if (db->engine == DB_ENGINE_BTREE) {
+        const char* hi = c->hi_len != UINT32_MAX ? c->hi : NULL;
+        c->done = !tree_scan(db, c->last, c->last_len, c->started, hi, c->hi_len, _cursor_add_key, c);
+    } else {
+        _cursor_fill_table(c);
+    }
+
+    pager_hint(db, hint);
+    if (!in_txn)
+        unlock_read(db);
+}
+
+//sets 'key' and 'value' to the next record, returning -1 once the partition has been read
+//both point into the cursor and are valid until the next call
+int db_cursor_next(struct DbCursor* c, struct DbSlice* key, struct DbSlice* value) {
+    while (c->pos == c->len) {
+        if (c->done)
+            return -1;
+        _cursor_fill(c);
+    }
+
+    char* ent = c->batch + c->pos;
+    memcpy(&key->len, ent, sizeof(uint32_t));
+    memcpy(&value->len, ent + sizeof(uint32_t), sizeof(uint32_t));
+    key->data = ent + sizeof(uint32_t) * 2;
+    value->data = key->data + key->len;
+    c->pos += sizeof(uint32_t) * 2 + key->len + value->len;
+    return 0;
+}
+
+void db_cursor_close(struct DbCursor* c) {
+    free(c->batch);
+    free(c);
+}
+
+//runs one step of online compaction, moving about 'budget' records, and starts a compaction if none is running
+//once every record has been moved to the front of the file the file is checkpointed and truncated
+//returns 1 while there is more to do, 0 when the compaction has finished (or could not start, the heap having
+//no room for the copy it makes), -1 for a B+tree database
+int db_compact(struct DB* db, uint32_t budget) {
+    if (db->engine != DB_ENGINE_HASH)
+        return -1;
+
+    if (_db_in_txn(db))
+        return table_compact_step(db, budget, true);
+
+    lock_exclusive(db);
+
+    bool more = table_compact_step(db, budget, true);
+
+    table_commit(db);
+    if (!more)
+        pager_checkpoint(db);
+    lock_release(db);
+    wal_sync(db);
+    return more;
+}
@@ -3,22 +3,146 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
 
+#define DB_CACHE_DEFAULT (1024 * 1024)
+
+enum DbEngine {
+    DB_ENGINE_HASH,
+    DB_ENGINE_BTREE //ordered, supports db_range
+};
+
+//how the index file is locked by the current operation, see lock.c
+enum DbLockMode {
+    DB_LOCK_NONE,
+    DB_LOCK_SHARED,
+    DB_LOCK_EXCLUSIVE
+};
+
+//a handle can be used by many threads at once; each thread scanning with db_nextrec has its own position
 struct DB {
-    FILE* idxf;
-    uint32_t chain_off;
-    uint32_t idxrec_off;
-    struct Block* blocks;
-    struct Block* super;
+    int idxfd;
+    enum DbEngine engine;
+    pthread_key_t scan; //this thread's struct DbScan
+    struct DbScan* scans; //every thread's, freed by db_close
+    pthread_mutex_t scans_lock;
+    struct Pager* pager;
+    struct Wal* wal;
+    struct SharedPool* shared; //NULL without DBOptions.shared_cache_bytes
+    struct Checkpointer* checkpointer; //NULL without DBOptions.checkpoint_ms
+    bool in_txn;
+    pthread_t txn_owner;
+    enum DbLockMode lock_mode;
+    bool alloc_locked;
+    pthread_rwlock_t latch; //see lock.c
+    pthread_rwlock_t snap_latch;
+    pthread_mutex_t readers_lock;
+    pthread_cond_t readers_cond;
+    uint32_t readers; //threads holding snapshots
+    uint32_t reader_joins;
+    bool snapshots_locked;
+    bool snapshots_draining;
+};
+
+enum DbCachePolicy {
+    DB_CACHE_LRU,
+    DB_CACHE_2Q //scan resistant
+};
+
+enum DbIoMode {
+    DB_IO_POOL, //positional I/O through the buffer pool
+    DB_IO_MMAP //read pages straight from a shared mapping of the file
+};
+
+//a key or value of 'len' bytes, which may hold NUL bytes
+//keys and values stored this way are only read back whole through the slice calls (db_get_into, db_get_view):
+//the C string calls stop at the first NUL
+struct DbSlice {
+    const char* data;
+    uint32_t len;
+};
+
+//a value read in place by db_get_view, valid until db_view_release
+struct DbView {
+    const char* data;
+    uint32_t len;
+    struct Block* frame; //cache frame 'data' points into, NULL if the value had to be copied
+    char* copy;
+};
+
+enum DbWriteType {
+    DB_WRITE_STORE,
+    DB_WRITE_DELETE
+};
+
+struct DbWriteOp {
+    enum DbWriteType type;
+    const char* key;
+    const char* value; //unused for DB_WRITE_DELETE
+};
+
+//passing NULL options to db_open uses the defaults
+struct DBOptions {
+    uint64_t cache_bytes; //buffer pool budget, 0 for DB_CACHE_DEFAULT
+    bool huge_pages; //back buffer pool with huge pages if the system has them
+    enum DbCachePolicy cache_policy;
+    enum DbIoMode io_mode;
+    bool async_io; //submit reads and writes that can overlap together through io_uring, if the kernel allows it
+    bool no_sync; //skip fsync on commit, changes are then only durable after a checkpoint
+    enum DbEngine engine; //only used when the database is created, existing files keep their engine
+    uint64_t shared_cache_bytes; //block images shared by every process opening the file with this set, 0 for none
+    uint32_t checkpoint_ms; //checkpoint from a background thread this often, 0 to leave checkpoints to writers
+    uint64_t checkpoint_bytes_per_sec; //write rate the background checkpoints are held to, 0 for no limit
+};
+
+//called by db_range for each key in order, returning nonzero stops the scan
+//it runs with the database locked and must not call back into the database
+typedef int (*DbRangeFn)(const char* key, const char* value, void* arg);
+
+//a scan of the database, or of one partition of it, that returns keys with their values
+//see db_cursor_open - a cursor is used by one thread at a time, and any number of them can run at once
+struct DbCursor;
+
+//a fetch started by db_fetch_submit and handed back by db_fetch_reap, see db_fetch_queue_open
+struct DbFetch {
+    struct DbSlice key;
+    void* tag; //the caller's, to tell fetches apart when they are reaped
+    char* value; //set on completion: the value (null terminated, freed by the caller), or NULL if there is no such key
+    uint32_t len;
+    struct DbFetch* next; //used by the queue
 };
 
-struct DB* db_open(const char* dbname);
+struct DbFetchQueue;
+
+struct DB* db_open(const char* dbname, const struct DBOptions* opts);
+void db_set_cache_size(struct DB* db, uint64_t cache_bytes);
 void db_close(struct DB* db);
 char* db_fetch(struct DB* db, const char* key);
 void db_rewind(struct DB* db);
 char* db_nextrec(struct DB* db);
 void db_delete(struct DB* db, const char* key);
 int db_store(struct DB* db, const char* key, const char* value);
+int db_put(struct DB* db, struct DbSlice key, struct DbSlice value);
+int db_del(struct DB* db, struct DbSlice key);
+int db_get_into(struct DB* db, struct DbSlice key, char* buf, uint32_t buf_len, uint32_t* value_len);
+int db_get_view(struct DB* db, struct DbSlice key, struct DbView* view);
+void db_view_release(struct DB* db, struct DbView* view);
+int db_multi_get(struct DB* db, const struct DbSlice* keys, uint32_t count, char* buf, uint32_t buf_len, struct DbSlice* values);
+struct DbFetchQueue* db_fetch_queue_open(struct DB* db, uint32_t depth);
+int db_fetch_submit(struct DbFetchQueue* q, struct DbFetch* f);
+uint32_t db_fetch_reap(struct DbFetchQueue* q, struct DbFetch** done, uint32_t max, bool wait);
+void db_fetch_queue_close(struct DbFetchQueue* q);
+int db_begin(struct DB* db);
+int db_commit(struct DB* db);
+int db_abort(struct DB* db);
+int db_write_batch(struct DB* db, const struct DbWriteOp* ops, uint32_t count);
+int db_multi_put(struct DB* db, const struct DbSlice* keys, const struct DbSlice* values, uint32_t count);
+int db_range(struct DB* db, const char* lo, const char* hi, DbRangeFn cb, void* arg);
+struct DbCursor* db_cursor_open(struct DB* db, uint32_t part, uint32_t parts);
+int db_cursor_next(struct DbCursor* c, struct DbSlice* key, struct DbSlice* value);
+void db_cursor_close(struct DbCursor* c);
+int db_compact(struct DB* db, uint32_t budget);
 
 
 void err_quit(const char* msg);
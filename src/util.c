@@ -1,4 +1,9 @@
+#define _GNU_SOURCE //open file description locks
 #include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
 
 #include "util.h"
 
@@ -7,14 +12,7 @@ void err_quit(const char* msg) {
     exit(1);
 }
 
-int _fileno(FILE* f) {
-    int res;
-    if ((res = fileno(f)) < 0)
-        err_quit("fileno failed");
-    return res;
-}
-
-int _read_lock(FILE* f, short whence, off_t start, off_t len) {
+int _read_lock(int fd, short whence, off_t start, off_t len) {
     struct flock fl;
     fl.l_type = F_RDLCK;
     fl.l_whence = whence;
@@ -22,12 +20,12 @@ int _read_lock(FILE* f, short whence, off_t start, off_t len) {
     fl.l_len = len;
 
     int res;
-    if ((res = fcntl(_fileno(f), F_SETLKW, &fl)) < 0)
+    if ((res = fcntl(fd, F_SETLKW, &fl)) < 0)
         err_quit("fcntl failed");
     return res;
 }
 
-int _write_lock(FILE* f, short whence, off_t start, off_t len) {
+int _write_lock(int fd, short whence, off_t start, off_t len) {
     struct flock fl;
     fl.l_type = F_WRLCK;
     fl.l_whence = whence;
@@ -35,12 +33,44 @@ int _write_lock(FILE* f, short whence, off_t start, off_t len) {
     fl.l_len = len;
 
     int res;
-    if ((res = fcntl(_fileno(f), F_SETLKW, &fl)) < 0)
+    if ((res = fcntl(fd, F_SETLKW, &fl)) < 0)
         err_quit("fcntl failed");
     return res;
 }
 
-int _unlock(FILE* f, short whence, off_t start, off_t len) {
+//open file description locks belong to the descriptor instead of the process, so the kernel does not
+//take threads of one process waiting on another for a deadlock
+//returns false instead of waiting if 'wait' is not set and another descriptor holds a conflicting lock
+bool _ofd_lock(int fd, short type, off_t start, off_t len, bool wait) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    if (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) == 0)
+        return true;
+    if (wait || (errno != EACCES && errno != EAGAIN))
+        err_quit("fcntl failed");
+    return false;
+}
+
+//true if another descriptor holds an open file description write lock on any of the range
+bool _ofd_write_locked(int fd, off_t start, off_t len) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    if (fcntl(fd, F_OFD_GETLK, &fl) < 0)
+        err_quit("fcntl failed");
+    return fl.l_type == F_WRLCK;
+}
+
+int _unlock(int fd, short whence, off_t start, off_t len) {
     struct flock fl;
     fl.l_type = F_UNLCK;
     fl.l_whence = whence;
@@ -48,48 +78,78 @@ int _unlock(FILE* f, short whence, off_t start, off_t len) {
     fl.l_len = len;
 
     int res;
-    if ((res = fcntl(_fileno(f), F_SETLKW, &fl)) < 0)
+    if ((res = fcntl(fd, F_SETLKW, &fl)) < 0)
         err_quit("fcntl failed");
     return res;
 }
 
-size_t _fread(void* ptr, size_t size, size_t count, FILE* f) {
-    size_t res;
-    if ((res = fread(ptr, size, count, f)) != count) {
-        err_quit("fread failed");
-    }
+//short reads are allowed since blocks at the end of the file may be partial
+size_t _pread(int fd, void* ptr, size_t count, off_t off) {
+    ssize_t res;
+    if ((res = pread(fd, ptr, count, off)) < 0)
+        err_quit("pread failed");
 
     return res;
 }
 
-size_t _fwrite(void* ptr, size_t size, size_t count, FILE* f) {
-    size_t res;
-    if ((res = fwrite(ptr, size, count, f)) != count)
-        err_quit("fwrite failed");
+size_t _pwrite(int fd, const void* ptr, size_t count, off_t off) {
+    ssize_t res;
+    if ((res = pwrite(fd, ptr, count, off)) != (ssize_t)count)
+        err_quit("pwrite failed");
 
     return res;
 }
 
-int _fseek(FILE* f, long offset, int origin) {
-    int res;
-    if ((res = fseek(f, offset, origin)) != 0)
-        err_quit("fseek failed");
+size_t _preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+    ssize_t res;
+    if ((res = preadv(fd, iov, iovcnt, off)) < 0)
+        err_quit("preadv failed");
 
     return res;
 }
 
-long _ftell(FILE* f) {
-    long res;
-    if ((res = ftell(f)) == -1)
-        err_quit("ftell failed");
+size_t _pwritev(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    ssize_t res;
+    if ((res = pwritev(fd, iov, iovcnt, off)) != (ssize_t)len)
+        err_quit("pwritev failed");
+
     return res;
 }
 
-FILE* _fopen(const char* filename, const char* mode) {
-    FILE* f;
-    if (!(f = fopen(filename, mode)))
-        err_quit("fopen failed");
-    return f;
+void _fdatasync(int fd) {
+    if (fdatasync(fd) < 0)
+        err_quit("fdatasync failed");
+}
+
+uint64_t _file_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        err_quit("fstat failed");
+    return st.st_size;
+}
+
+void _ftruncate(int fd, uint64_t size) {
+    if (ftruncate(fd, size) < 0)
+        err_quit("ftruncate failed");
+}
+
+//reserves disk space so the file grows in large contiguous pieces
+void _fallocate(int fd, uint64_t off, uint64_t len) {
+    int err = posix_fallocate(fd, off, len);
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+        err_quit("fallocate failed");
+}
+
+int _open(const char* filename, int flags) {
+    int fd;
+    if ((fd = open(filename, flags, 0644)) < 0)
+        err_quit("open failed");
+    return fd;
 }
 
 void* _calloc(size_t count, size_t size) {
@@ -2,19 +2,28 @@
 #define UDB_UTIL_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 void err_quit(const char* msg);
 
-int _fileno(FILE* f);
-int _read_lock(FILE* f, short whence, off_t start, off_t len);
-int _write_lock(FILE* f, short whence, off_t start, off_t len);
-int _unlock(FILE* f, short whence, off_t start, off_t len);
-size_t _fread(void* ptr, size_t size, size_t count, FILE* f);
-size_t _fwrite(void* ptr, size_t size, size_t count, FILE* f);
-int _fseek(FILE* f, long offset, int origin);
-long _ftell(FILE* f);
-FILE* _fopen(const char* filename, const char* mode);
+int _read_lock(int fd, short whence, off_t start, off_t len);
+int _write_lock(int fd, short whence, off_t start, off_t len);
+int _unlock(int fd, short whence, off_t start, off_t len);
+bool _ofd_lock(int fd, short type, off_t start, off_t len, bool wait);
+bool _ofd_write_locked(int fd, off_t start, off_t len);
+size_t _pread(int fd, void* ptr, size_t count, off_t off);
+size_t _pwrite(int fd, const void* ptr, size_t count, off_t off);
+size_t _preadv(int fd, const struct iovec* iov, int iovcnt, off_t off);
+size_t _pwritev(int fd, const struct iovec* iov, int iovcnt, off_t off);
+void _fdatasync(int fd);
+uint64_t _file_size(int fd);
+void _ftruncate(int fd, uint64_t size);
+void _fallocate(int fd, uint64_t off, uint64_t len);
+int _open(const char* filename, int flags);
 void* _calloc(size_t count, size_t size);
 void* _malloc(size_t size);
 
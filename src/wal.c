@@ -0,0 +1,612 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "wal.h"
+#include "pager.h"
+#include "util.h"
+
+//FNV-1a over the frame position and payload, so torn or stale frames are rejected
+static uint32_t _wal_checksum(const struct WalFrame* f, const char* payload) {
+    uint32_t hash = 2166136261u;
+    const uint8_t* fields = (const uint8_t*)&f->lsn;
+    for (uint32_t i = 0; i < sizeof(uint64_t); i++) {
+        hash ^= fields[i];
+        hash *= 16777619;
+    }
+    hash ^= f->gen;
+    hash *= 16777619;
+    for (uint32_t i = 0; i < f->len; i++) {
+        hash ^= (uint8_t)payload[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+inline static uint32_t _wal_hash_idx(struct WalLog* l, uint32_t idx) {
+    return (idx * 2654435761u) & (l->table_size - 1);
+}
+
+static void _wal_log_init(struct WalLog* l) {
+    memset(l, 0, sizeof(struct WalLog));
+    l->table_size = WAL_INDEX_MIN;
+    l->table = _calloc(l->table_size, sizeof(struct WalEntry*));
+}
+
+static void _wal_log_clear(struct WalLog* l) {
+    for (uint32_t i = 0; i < l->table_size; i++) {
+        struct WalEntry* cur = l->table[i];
+        while (cur) {
+            struct WalEntry* next = cur->next;
+            free(cur->recs);
+            free(cur);
+            cur = next;
+        }
+        l->table[i] = NULL;
+    }
+    l->len = 0;
+    l->entries = 0;
+}
+
+static void _wal_log_free(struct WalLog* l) {
+    _wal_log_clear(l);
+    free(l->table);
+    free(l->buf);
+}
+
+static struct WalEntry* _wal_find_entry(struct WalLog* l, uint32_t idx) {
+    struct WalEntry* cur = l->table[_wal_hash_idx(l, idx)];
+    while (cur && cur->idx != idx) {
+        cur = cur->next;
+    }
+    return cur;
+}
+
+static void _wal_grow_table(struct WalLog* l) {
+    uint32_t old_size = l->table_size;
+    struct WalEntry** old = l->table;
+
+    l->table_size *= 2;
+    l->table = _calloc(l->table_size, sizeof(struct WalEntry*));
+    for (uint32_t i = 0; i < old_size; i++) {
+        struct WalEntry* cur = old[i];
+        while (cur) {
+            struct WalEntry* next = cur->next;
+            uint32_t h = _wal_hash_idx(l, cur->idx);
+            cur->next = l->table[h];
+            l->table[h] = cur;
+            cur = next;
+        }
+    }
+    free(old);
+}
+
+static struct WalEntry* _wal_get_entry(struct WalLog* l, uint32_t idx) {
+    struct WalEntry* e = _wal_find_entry(l, idx);
+    if (e)
+        return e;
+
+    if (l->entries >= l->table_size)
+        _wal_grow_table(l);
+
+    e = _calloc(1, sizeof(struct WalEntry));
+    e->idx = idx;
+    uint32_t h = _wal_hash_idx(l, idx);
+    e->next = l->table[h];
+    l->table[h] = e;
+    l->entries++;
+    return e;
+}
+
+static void _wal_reserve(struct WalLog* l, uint32_t len) {
+    if (l->len + len <= l->cap)
+        return;
+
+    while (l->len + len > l->cap) {
+        l->cap = l->cap ? l->cap * 2 : BLOCK_SIZE;
+    }
+    if (!(l->buf = realloc(l->buf, l->cap)))
+        err_quit("realloc failed");
+}
+
+//appends a record that lies within one block
+//if the previous record for the block covered exactly the same bytes it is overwritten instead,
+//so repeated updates of a chain head in one operation stay compact
+//returns the block's entry
+static struct WalEntry* _wal_log_append(struct WalLog* l, uint64_t off, const char* data, uint32_t len, bool coalesce) {
+    struct WalEntry* e = _wal_get_entry(l, off / BLOCK_SIZE);
+
+    if (coalesce && e->count) {
+        struct WalRecord last;
+        memcpy(&last, l->buf + e->recs[e->count - 1], sizeof(struct WalRecord));
+        if (last.off == off && last.len == len) {
+            memcpy(l->buf + e->recs[e->count - 1] + sizeof(struct WalRecord), data, len);
+            return e;
+        }
+    }
+
+    if (e->count == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 4;
+        if (!(e->recs = realloc(e->recs, e->cap * sizeof(uint32_t))))
+            err_quit("realloc failed");
+    }
+    e->recs[e->count++] = l->len;
+
+    struct WalRecord r = { off, len, 0 };
+    _wal_reserve(l, sizeof(struct WalRecord) + len);
+    memcpy(l->buf + l->len, &r, sizeof(struct WalRecord));
+    memcpy(l->buf + l->len + sizeof(struct WalRecord), data, len);
+    l->len += sizeof(struct WalRecord) + len;
+    return e;
+}
+
+//adds the records of a frame payload to the committed log, patching cached blocks if requested
+//a block is patched after its record is in the log, so a reader loading it meanwhile gets the record either way
+//'end_lsn' is where the frame ends
+static void _wal_append_payload(struct DB* db, const char* payload, uint32_t len, uint64_t end_lsn, bool patch) {
+    struct Wal* w = db->wal;
+    uint32_t pos = 0;
+    while (pos < len) {
+        struct WalRecord r;
+        memcpy(&r, payload + pos, sizeof(struct WalRecord));
+        const char* data = payload + pos + sizeof(struct WalRecord);
+        pthread_rwlock_wrlock(&w->log_latch);
+        _wal_log_append(&w->committed, r.off, data, r.len, false)->lsn = end_lsn;
+        pthread_rwlock_unlock(&w->log_latch);
+        if (patch)
+            pager_patch(db, r.off, data, r.len);
+        pos += sizeof(struct WalRecord) + r.len;
+    }
+}
+
+//lets new snapshots see everything committed so far
+static void _wal_publish(struct Wal* w) {
+    pthread_rwlock_wrlock(&w->log_latch);
+    w->visible = w->committed.len;
+    w->visible_lsn = w->lsn;
+    pthread_rwlock_unlock(&w->log_latch);
+}
+
+//returns the indexes of all blocks with records in 'l', caller frees
+static uint32_t* _wal_log_blocks(struct WalLog* l, uint32_t* count) {
+    uint32_t* blocks = _malloc((l->entries ? l->entries : 1) * sizeof(uint32_t));
+
+    *count = 0;
+    for (uint32_t i = 0; i < l->table_size; i++) {
+        for (struct WalEntry* e = l->table[i]; e; e = e->next) {
+            blocks[(*count)++] = e->idx;
+        }
+    }
+    return blocks;
+}
+
+//writes everything but durable_lsn, which other processes may be raising meanwhile
+static void _wal_write_header(struct Wal* w) {
+    struct WalHeader h = { WAL_MAGIC, w->gen, w->start_lsn, w->lsn, 0 };
+    _pwrite(w->fd, &h, offsetof(struct WalHeader, durable_lsn), 0);
+}
+
+//overwrites durable_lsn, only while the file is write-locked and nobody can have synced past 'lsn'
+static void _wal_write_durable(struct Wal* w, uint64_t lsn) {
+    _pwrite(w->fd, &lsn, sizeof(uint64_t), offsetof(struct WalHeader, durable_lsn));
+}
+
+//how far the log is known to be durable in any process
+static uint64_t _wal_shared_durable(struct Wal* w) {
+    return __atomic_load_n(&w->header->durable_lsn, __ATOMIC_ACQUIRE);
+}
+
+//the end of the log as last committed by any process
+static uint64_t _wal_shared_end(struct Wal* w) {
+    return __atomic_load_n(&w->header->end_lsn, __ATOMIC_ACQUIRE);
+}
+
+//raises durable_lsn to 'lsn' after a sync, unless another process has already published more
+static void _wal_publish_durable(struct Wal* w, uint64_t lsn) {
+    uint64_t cur = __atomic_load_n(&w->header->durable_lsn, __ATOMIC_ACQUIRE);
+    while (cur < lsn && !__atomic_compare_exchange_n(&w->header->durable_lsn, &cur, lsn, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+//'fresh' discards whatever is in the log, for a newly created index file
+//returns true if the log was started from scratch
+//NOTE: index file should be write-locked
+bool wal_open(struct DB* db, const char* filename, bool sync, bool fresh) {
+    struct Wal* w = _calloc(1, sizeof(struct Wal));
+    w->fd = _open(filename, O_RDWR | O_CREAT);
+    w->sync = sync;
+
+    bool created = fresh || _file_size(w->fd) < WAL_HEADER_SIZE;
+    if (created) {
+        _ftruncate(w->fd, 0);
+        w->gen = 1;
+        _wal_write_durable(w, 0);
+        _wal_write_header(w);
+    }
+
+    //every operation checks the header for new frames, through a shared mapping rather than a read
+    w->header = mmap(NULL, WAL_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if (w->header == MAP_FAILED)
+        err_quit("mmap failed");
+
+    //generation 0 is never used, so the first catch up reads the whole log
+    w->gen = 0;
+    _wal_log_init(&w->committed);
+    _wal_log_init(&w->pending);
+    pthread_rwlock_init(&w->log_latch, NULL);
+    pthread_mutex_init(&w->sync_lock, NULL);
+    pthread_cond_init(&w->sync_cond, NULL);
+
+    db->wal = w;
+    return created;
+}
+
+void wal_close(struct DB* db) {
+    struct Wal* w = db->wal;
+    munmap(w->header, WAL_HEADER_SIZE);
+    close(w->fd);
+    _wal_log_free(&w->committed);
+    _wal_log_free(&w->pending);
+    pthread_rwlock_destroy(&w->log_latch);
+    pthread_mutex_destroy(&w->sync_lock);
+    pthread_cond_destroy(&w->sync_cond);
+    free(w);
+}
+
+//reads frames committed by other processes since the last call and applies them to cached blocks
+//if the log was checkpointed in the meantime, any frames that were missed are in the index file now,
+//so cached blocks are only dropped when this process had not read up to the checkpoint
+//a frame with a bad checksum ends the log: it was torn by a crash before its commit became durable
+//NOTE: file should be locked
+void wal_catch_up(struct DB* db) {
+    struct Wal* w = db->wal;
+    struct WalHeader h;
+    memcpy(&h, w->header, sizeof(struct WalHeader));
+
+    if (h.gen != w->gen) {
+        //no reader in this process holds a snapshot, or the other process could not have checkpointed
+        pthread_rwlock_wrlock(&w->log_latch);
+        if (w->lsn != h.start_lsn)
+            pager_invalidate(db);
+        _wal_log_clear(&w->committed);
+        w->visible = 0;
+        w->visible_lsn = h.start_lsn;
+        w->gen = h.gen;
+        w->start_lsn = h.start_lsn;
+        w->lsn = h.start_lsn;
+        pager_refresh_size(db);
+        pthread_rwlock_unlock(&w->log_latch);
+    }
+
+    if (h.end_lsn <= w->lsn)
+        return;
+
+    uint32_t len = h.end_lsn - w->lsn;
+    char* buf = _malloc(len);
+    len = _pread(w->fd, buf, len, WAL_HEADER_SIZE + (w->lsn - w->start_lsn));
+
+    uint32_t pos = 0;
+    while (pos + sizeof(struct WalFrame) <= len) {
+        struct WalFrame f;
+        memcpy(&f, buf + pos, sizeof(struct WalFrame));
+        const char* payload = buf + pos + sizeof(struct WalFrame);
+        if (f.magic != WAL_FRAME_MAGIC || f.gen != w->gen || f.lsn != w->lsn ||
+            pos + sizeof(struct WalFrame) + f.len > len || _wal_checksum(&f, payload) != f.checksum)
+            break;
+
+        _wal_append_payload(db, payload, f.len, f.lsn + sizeof(struct WalFrame) + f.len, true);
+        pos += sizeof(struct WalFrame) + f.len;
+        pthread_rwlock_wrlock(&w->log_latch);
+        w->lsn += sizeof(struct WalFrame) + f.len;
+        pthread_rwlock_unlock(&w->log_latch);
+    }
+
+    free(buf);
+    _wal_publish(w);
+}
+
+//the committed log prefix a new snapshot reads, see pager.c
+//returns false if another process has checkpointed and the handle has yet to catch up with it
+bool wal_snapshot(struct DB* db, uint32_t* len) {
+    struct Wal* w = db->wal;
+    struct WalHeader h;
+    memcpy(&h, w->header, sizeof(struct WalHeader));
+
+    pthread_rwlock_rdlock(&w->log_latch);
+    bool current = h.gen == w->gen;
+    *len = w->visible;
+    pthread_rwlock_unlock(&w->log_latch);
+    return current;
+}
+
+//true if another process has committed or checkpointed since this handle last caught up
+bool wal_behind(struct DB* db) {
+    struct Wal* w = db->wal;
+    struct WalHeader h;
+    memcpy(&h, w->header, sizeof(struct WalHeader));
+
+    pthread_rwlock_rdlock(&w->log_latch);
+    bool behind = h.gen != w->gen || h.end_lsn > w->lsn;
+    pthread_rwlock_unlock(&w->log_latch);
+    return behind;
+}
+
+//true if another process has checkpointed since this handle last caught up
+bool wal_stale(struct DB* db) {
+    struct Wal* w = db->wal;
+    struct WalHeader h;
+    memcpy(&h, w->header, sizeof(struct WalHeader));
+
+    pthread_rwlock_rdlock(&w->log_latch);
+    bool stale = h.gen != w->gen;
+    pthread_rwlock_unlock(&w->log_latch);
+    return stale;
+}
+
+//records bytes written by the current operation, split at block boundaries
+void wal_log(struct DB* db, uint64_t file_off, const char* buf, uint32_t len) {
+    pthread_rwlock_wrlock(&db->wal->log_latch);
+    while (len) {
+        uint32_t to_block_end = BLOCK_SIZE - file_off % BLOCK_SIZE;
+        uint32_t n = len < to_block_end ? len : to_block_end;
+        _wal_log_append(&db->wal->pending, file_off, buf, n, true);
+        file_off += n;
+        buf += n;
+        len -= n;
+    }
+    pthread_rwlock_unlock(&db->wal->log_latch);
+}
+
+bool wal_has_block(struct DB* db, uint32_t idx) {
+    pthread_rwlock_rdlock(&db->wal->log_latch);
+    bool found = _wal_find_entry(&db->wal->committed, idx) || _wal_find_entry(&db->wal->pending, idx);
+    pthread_rwlock_unlock(&db->wal->log_latch);
+    return found;
+}
+
+//replays the records of 'e' that start in [start, end) of the log onto the block
+static void _wal_apply_entry(struct WalLog* l, struct WalEntry* e, char* buf, uint32_t start, uint32_t end) {
+    uint32_t j = 0;
+    while (j < e->count && e->recs[j] < start) {
+        j++;
+    }
+    for (; j < e->count && e->recs[j] < end; j++) {
+        struct WalRecord r;
+        memcpy(&r, l->buf + e->recs[j], sizeof(struct WalRecord));
+        memcpy(buf + r.off % BLOCK_SIZE, l->buf + e->recs[j] + sizeof(struct WalRecord), r.len);
+    }
+}
+
+//replays committed and then pending records for a block onto its index file contents
+//returns true if the block has pending records
+bool wal_apply_block(struct DB* db, uint32_t idx, char* buf) {
+    return wal_apply_block_from(db, idx, buf, 0);
+}
+
+//replays the committed records from byte 'len' of the log on, then the pending ones, finishing a block
+//that wal_apply_block_to has replayed the first 'len' bytes onto
+//returns true if the block has pending records
+bool wal_apply_block_from(struct DB* db, uint32_t idx, char* buf, uint32_t len) {
+    struct Wal* w = db->wal;
+    pthread_rwlock_rdlock(&w->log_latch);
+    struct WalEntry* e = _wal_find_entry(&w->committed, idx);
+    if (e)
+        _wal_apply_entry(&w->committed, e, buf, len, UINT32_MAX);
+    if ((e = _wal_find_entry(&w->pending, idx)))
+        _wal_apply_entry(&w->pending, e, buf, 0, UINT32_MAX);
+    pthread_rwlock_unlock(&w->log_latch);
+    return e != NULL;
+}
+
+//replays only the pending records, onto a block image that already has every committed one
+bool wal_apply_pending(struct DB* db, uint32_t idx, char* buf) {
+    return wal_apply_block_from(db, idx, buf, UINT32_MAX);
+}
+
+//the length of the committed log new snapshots read, and in 'lsn' the end of the last frame in it
+uint32_t wal_published(struct DB* db, uint64_t* lsn) {
+    struct Wal* w = db->wal;
+    pthread_rwlock_rdlock(&w->log_latch);
+    uint32_t len = w->visible;
+    *lsn = w->visible_lsn;
+    pthread_rwlock_unlock(&w->log_latch);
+    return len;
+}
+
+//the lsns a shared image of a block can have and still be the block as the handle has it, without pending records
+//one built before the last checkpoint or before the block's last committed record is out of date,
+//and one past the last frame published here may hold records the handle has yet to read
+//returns false if there is no such lsn
+bool wal_image_range(struct DB* db, uint32_t idx, uint64_t* min_lsn, uint64_t* max_lsn) {
+    struct Wal* w = db->wal;
+    pthread_rwlock_rdlock(&w->log_latch);
+    struct WalEntry* e = _wal_find_entry(&w->committed, idx);
+    *min_lsn = e && e->lsn > w->start_lsn ? e->lsn : w->start_lsn;
+    *max_lsn = w->visible_lsn;
+    pthread_rwlock_unlock(&w->log_latch);
+    return *min_lsn <= *max_lsn;
+}
+
+//true if a committed record for the block lies past the first 'len' bytes of the log
+bool wal_changed_since(struct DB* db, uint32_t idx, uint32_t len) {
+    struct Wal* w = db->wal;
+    pthread_rwlock_rdlock(&w->log_latch);
+    struct WalEntry* e = _wal_find_entry(&w->committed, idx);
+    bool changed = e && e->recs[e->count - 1] >= len;
+    pthread_rwlock_unlock(&w->log_latch);
+    return changed;
+}
+
+//replays only the committed records in the first 'len' bytes of the log, rebuilding a block for a snapshot
+void wal_apply_block_to(struct DB* db, uint32_t idx, char* buf, uint32_t len) {
+    struct Wal* w = db->wal;
+    pthread_rwlock_rdlock(&w->log_latch);
+    struct WalEntry* e = _wal_find_entry(&w->committed, idx);
+    if (e)
+        _wal_apply_entry(&w->committed, e, buf, 0, len);
+    pthread_rwlock_unlock(&w->log_latch);
+}
+
+bool wal_pending(struct DB* db) {
+    return db->wal->pending.len > 0;
+}
+
+//appends the pending records as one frame and makes them part of the committed log
+//the frame is not durable until wal_sync, which can run after the file lock is released
+//NOTE: file should be write-locked
+void wal_commit(struct DB* db) {
+    struct Wal* w = db->wal;
+    struct WalLog* p = &w->pending;
+
+    struct WalFrame f;
+    f.magic = WAL_FRAME_MAGIC;
+    f.gen = w->gen;
+    f.lsn = w->lsn;
+    f.len = p->len;
+    f.checksum = _wal_checksum(&f, p->buf);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &f;
+    iov[0].iov_len = sizeof(struct WalFrame);
+    iov[1].iov_base = p->buf;
+    iov[1].iov_len = p->len;
+    _pwritev(w->fd, iov, 2, WAL_HEADER_SIZE + (w->lsn - w->start_lsn));
+
+    pthread_rwlock_wrlock(&w->log_latch);
+    w->lsn += sizeof(struct WalFrame) + p->len;
+    pthread_rwlock_unlock(&w->log_latch);
+    _wal_write_header(w);
+
+    //blocks stay dirty until their records are committed, so readers never take them for a snapshot early
+    uint32_t count;
+    uint32_t* blocks = _wal_log_blocks(p, &count);
+    _wal_append_payload(db, p->buf, p->len, w->lsn, false);
+    pthread_rwlock_wrlock(&w->log_latch);
+    _wal_log_clear(p);
+    pthread_rwlock_unlock(&w->log_latch);
+    for (uint32_t i = 0; i < count; i++) {
+        pager_mark_clean(db, blocks[i]);
+    }
+    free(blocks);
+    _wal_publish(w);
+
+    pthread_mutex_lock(&w->sync_lock);
+    if (w->lsn > w->written_lsn)
+        w->written_lsn = w->lsn;
+    pthread_mutex_unlock(&w->sync_lock);
+}
+
+void wal_abort(struct DB* db) {
+    struct Wal* w = db->wal;
+    uint32_t count;
+    uint32_t* blocks = _wal_log_blocks(&w->pending, &count);
+    pthread_rwlock_wrlock(&w->log_latch);
+    _wal_log_clear(&w->pending);
+    pthread_rwlock_unlock(&w->log_latch);
+    for (uint32_t i = 0; i < count; i++) {
+        pager_drop_block(db, blocks[i]);
+    }
+    free(blocks);
+}
+
+//syncs the log up to at least 'target', one process at a time: a process that had to wait for the sync lock
+//usually finds its frames covered by the sync just published, and otherwise syncs every frame committed
+//(by any process) meanwhile, so processes that commit while a sync runs share the next one
+//returns how far the log is durable
+static uint64_t _wal_sync_file(struct Wal* w, uint64_t target) {
+    _ofd_lock(w->fd, F_WRLCK, WAL_SYNC_LOCK_OFF, 1, true);
+    uint64_t durable = _wal_shared_durable(w);
+    if (durable < target) {
+        //frames up to the end in the header were written before it, so the sync covers them too
+        uint64_t end = _wal_shared_end(w);
+        durable = end > target ? end : target;
+        _fdatasync(w->fd);
+        _wal_publish_durable(w, durable);
+    }
+    _ofd_lock(w->fd, F_UNLCK, WAL_SYNC_LOCK_OFF, 1, true);
+    return durable;
+}
+
+//group commit: the first caller to find the log not yet durable becomes the leader and runs one
+//fdatasync covering every frame written so far, while other callers wait for it instead of syncing again
+//leaders of different processes take turns through _wal_sync_file
+void wal_sync(struct DB* db) {
+    struct Wal* w = db->wal;
+    if (!w->sync)
+        return;
+
+    pthread_mutex_lock(&w->sync_lock);
+    uint64_t target = w->written_lsn;
+    while (w->durable_lsn < target) {
+        if (w->syncing) {
+            pthread_cond_wait(&w->sync_cond, &w->sync_lock);
+            continue;
+        }
+
+        uint64_t batch = w->written_lsn;
+        w->syncing = true;
+        pthread_mutex_unlock(&w->sync_lock);
+        batch = _wal_sync_file(w, batch);
+        pthread_mutex_lock(&w->sync_lock);
+        w->syncing = false;
+        if (batch > w->durable_lsn)
+            w->durable_lsn = batch;
+        pthread_cond_broadcast(&w->sync_cond);
+    }
+    pthread_mutex_unlock(&w->sync_lock);
+}
+
+//makes every written frame durable regardless of the sync option, used before a checkpoint
+//writes blocks into the index file
+void wal_flush(struct DB* db) {
+    struct Wal* w = db->wal;
+    _fdatasync(w->fd);
+    _wal_publish_durable(w, w->lsn);
+
+    pthread_mutex_lock(&w->sync_lock);
+    if (w->lsn > w->durable_lsn)
+        w->durable_lsn = w->lsn;
+    pthread_mutex_unlock(&w->sync_lock);
+}
+
+static int _wal_cmp_idx(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+//returns the sorted indexes of all blocks with committed records, caller frees
+uint32_t* wal_blocks(struct DB* db, uint32_t* count) {
+    uint32_t* blocks = _wal_log_blocks(&db->wal->committed, count);
+    qsort(blocks, *count, sizeof(uint32_t), _wal_cmp_idx);
+
+    return blocks;
+}
+
+//starts the next generation after a checkpoint has made the index file hold every committed record
+//NOTE: file should be write-locked
+void wal_reset(struct DB* db) {
+    struct Wal* w = db->wal;
+    pthread_rwlock_wrlock(&w->log_latch);
+    w->gen++;
+    w->start_lsn = w->lsn;
+    _wal_log_clear(&w->committed);
+    w->visible = 0;
+    w->visible_lsn = w->lsn;
+    pthread_rwlock_unlock(&w->log_latch);
+    _wal_write_durable(w, w->lsn);
+    _wal_write_header(w);
+    _ftruncate(w->fd, WAL_HEADER_SIZE);
+    _fdatasync(w->fd);
+
+    pthread_mutex_lock(&w->sync_lock);
+    w->durable_lsn = w->lsn;
+    pthread_mutex_unlock(&w->sync_lock);
+}
+
+uint32_t wal_size(struct DB* db) {
+    return db->wal->lsn - db->wal->start_lsn;
+}
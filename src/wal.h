@@ -0,0 +1,111 @@
+#ifndef UDB_WAL_H
+#define UDB_WAL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "urchin.h"
+
+#define WAL_MAGIC 0x324c5755 //"UWL2"
+#define WAL_FRAME_MAGIC 0x4d524657 //"WFRM"
+#define WAL_HEADER_SIZE sizeof(struct WalHeader)
+#define WAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+#define WAL_INDEX_MIN 64
+#define WAL_SYNC_LOCK_OFF ((off_t)1 << 40) //lock byte of the log file held while syncing it, past any frame
+
+//the write-ahead log is a header followed by frames, one per commit
+//a frame is a list of redo records (file offset, length, new bytes), each one within a single block
+//LSNs are byte positions in an endless log: a frame at file position pos has lsn start_lsn + pos - WAL_HEADER_SIZE
+//a checkpoint copies logged blocks into the index file, then resets the log with the next generation
+//durable_lsn is raised by whichever process last synced the log, and lets committers in every process skip
+//a sync that has already covered their frames; it is written apart from the rest, which only writers change
+struct WalHeader {
+    uint32_t magic;
+    uint32_t gen;
+    uint64_t start_lsn;
+    uint64_t end_lsn;
+    uint64_t durable_lsn;
+};
+
+struct WalFrame {
+    uint32_t magic;
+    uint32_t gen;
+    uint64_t lsn;
+    uint32_t len;
+    uint32_t checksum;
+};
+
+struct WalRecord {
+    uint64_t off;
+    uint32_t len;
+    uint32_t unused;
+};
+
+//offsets (into WalLog::buf) of every record touching one block, in log order
+struct WalEntry {
+    uint32_t idx;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t* recs;
+    uint64_t lsn; //end of the frame holding the last record, for committed records
+    struct WalEntry* next;
+};
+
+struct WalLog {
+    char* buf;
+    uint32_t len;
+    uint32_t cap;
+    struct WalEntry** table;
+    uint32_t table_size;
+    uint32_t entries;
+};
+
+//'committed' holds every frame since the last checkpoint (from any process), 'pending' the records
+//of the current operation - a block is rebuilt by reading it from the index file and replaying both
+//readers share both logs with the writer, so changes to them are made under 'log_latch'
+//a snapshot is a prefix of 'committed': the first 'visible' bytes are in every cached block,
+//and hold every frame up to 'visible_lsn'
+struct Wal {
+    int fd;
+    struct WalHeader* header; //shared mapping of the log header, only durable_lsn is written through it
+    uint32_t gen;
+    uint64_t start_lsn;
+    uint64_t lsn;
+    struct WalLog committed;
+    struct WalLog pending;
+    pthread_rwlock_t log_latch;
+    uint32_t visible;
+    uint64_t visible_lsn;
+    bool sync;
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    bool syncing;
+    uint64_t written_lsn;
+    uint64_t durable_lsn;
+};
+
+bool wal_open(struct DB* db, const char* filename, bool sync, bool fresh);
+void wal_close(struct DB* db);
+void wal_catch_up(struct DB* db);
+bool wal_snapshot(struct DB* db, uint32_t* len);
+void wal_log(struct DB* db, uint64_t file_off, const char* buf, uint32_t len);
+bool wal_has_block(struct DB* db, uint32_t idx);
+bool wal_apply_block(struct DB* db, uint32_t idx, char* buf);
+bool wal_apply_block_from(struct DB* db, uint32_t idx, char* buf, uint32_t len);
+bool wal_apply_pending(struct DB* db, uint32_t idx, char* buf);
+uint32_t wal_published(struct DB* db, uint64_t* lsn);
+bool wal_image_range(struct DB* db, uint32_t idx, uint64_t* min_lsn, uint64_t* max_lsn);
+bool wal_changed_since(struct DB* db, uint32_t idx, uint32_t len);
+void wal_apply_block_to(struct DB* db, uint32_t idx, char* buf, uint32_t len);
+bool wal_behind(struct DB* db);
+bool wal_stale(struct DB* db);
+bool wal_pending(struct DB* db);
+void wal_commit(struct DB* db);
+void wal_abort(struct DB* db);
+void wal_sync(struct DB* db);
+void wal_flush(struct DB* db);
+uint32_t* wal_blocks(struct DB* db, uint32_t* count);
+void wal_reset(struct DB* db);
+uint32_t wal_size(struct DB* db);
+
+#endif //UDB_WAL_H